@@ -0,0 +1,143 @@
+/**
+ * @file bayer_planar.cpp
+ *
+ * @brief bayer planar split/merge implement
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include "bayer_planar.h"
+
+ISP_USE_NAMESPACE
+
+BayerPlane_e ImageSignalProcessor::bayerPlaneAt(BayerCFAPattern_e cfa, int row, int col)
+{
+    CFADescriptor descriptor(cfa);
+    CFAColor_e color = descriptor.colorAt(row & 1, col & 1);
+
+    if (color == CFA_COLOR_R)
+        return BAYER_PLANE_R;
+    else if (color == CFA_COLOR_B)
+        return BAYER_PLANE_B;
+    else if (descriptor.colorAt(row & 1, (col & 1) ^ 1) == CFA_COLOR_R)
+        return BAYER_PLANE_GR;
+    else
+        return BAYER_PLANE_GB;
+}
+
+/* simple unit stride loops, vectorized by the compiler */
+template <typename T>
+static void _split_row(const T *src, uint16_t *even, uint16_t *odd,
+                       int count, int shift)
+{
+    for (int i = 0; i < count; i++) {
+        even[i] = src[2 * i] >> shift;
+        odd[i] = src[2 * i + 1] >> shift;
+    }
+}
+
+template <typename T>
+static void _merge_row(const uint16_t *even, const uint16_t *odd, T *dst,
+                       int count, int shift)
+{
+    for (int i = 0; i < count; i++) {
+        dst[2 * i] = static_cast<T>(even[i] << shift);
+        dst[2 * i + 1] = static_cast<T>(odd[i] << shift);
+    }
+}
+
+static bool _check_geometry(const BayerImageData &bayerImage,
+                            const BayerPlanarImageData &planar)
+{
+    if (planar.width != bayerImage.width || planar.height != bayerImage.height
+        || planar.planes[0] == nullptr) {
+        std::cout << "Planar image " << planar.width << "x" << planar.height
+            << " does not match bayer image " << bayerImage.width << "x"
+            << bayerImage.height << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int ImageSignalProcessor::bayerSplitPlanes(const BayerImageData &bayerImage,
+                                           BayerPlanarImageData &planar,
+                                           int planeRow, int planeRows)
+{
+    int bits = rawFormatBits(bayerImage.format);
+
+    if (bits < 0) {
+        std::cout << "Invalid bayer mem format " << bayerImage.format << std::endl;
+        return -1;
+    }
+    if (!_check_geometry(bayerImage, planar))
+        return -1;
+    if (planeRow < 0 || planeRows < 0 || planeRow + planeRows > planar.planeHeight) {
+        std::cout << "Invalid plane rows " << planeRow << " + " << planeRows << std::endl;
+        return -1;
+    }
+
+    int shift = rawFormatUnpackShift(bayerImage.format);
+    planar.bits = bits;
+
+    for (int i = planeRow; i < planeRow + planeRows; i++) {
+        for (int y = 0; y < 2; y++) {
+            const uint8_t *src = reinterpret_cast<const uint8_t *>(bayerImage.imageData)
+                + (2 * i + y) * bayerImage.stride;
+            uint16_t *even = planar.planeRow(bayerPlaneAt(planar.cfa, y, 0), i);
+            uint16_t *odd = planar.planeRow(bayerPlaneAt(planar.cfa, y, 1), i);
+
+            if (bayerImage.format == FORMAT_RAW8)
+                _split_row(src, even, odd, planar.planeWidth, shift);
+            else
+                _split_row(reinterpret_cast<const uint16_t *>(src), even, odd,
+                           planar.planeWidth, shift);
+        }
+    }
+
+    return 0;
+}
+
+int ImageSignalProcessor::bayerSplitPlanes(const BayerImageData &bayerImage,
+                                           BayerPlanarImageData &planar)
+{
+    return bayerSplitPlanes(bayerImage, planar, 0, planar.planeHeight);
+}
+
+int ImageSignalProcessor::bayerMergePlanes(const BayerPlanarImageData &planar,
+                                           BayerImageData &bayerImage)
+{
+    int bits = rawFormatBits(bayerImage.format);
+
+    if (bits < 0) {
+        std::cout << "Invalid bayer mem format " << bayerImage.format << std::endl;
+        return -1;
+    }
+    if (!_check_geometry(bayerImage, planar))
+        return -1;
+
+    if (planar.bits > bits) {
+        std::cout << "Planes of " << planar.bits << " bits do not fit "
+            << bits << " bits format" << std::endl;
+        return -1;
+    }
+
+    /* scale the planes to the bits of the format, then msb align */
+    int shift = rawFormatUnpackShift(bayerImage.format) + bits - planar.bits;
+
+    for (int i = 0; i < planar.planeHeight; i++) {
+        for (int y = 0; y < 2; y++) {
+            uint8_t *dst = reinterpret_cast<uint8_t *>(bayerImage.imageData)
+                + (2 * i + y) * bayerImage.stride;
+            const uint16_t *even = planar.planeRow(bayerPlaneAt(planar.cfa, y, 0), i);
+            const uint16_t *odd = planar.planeRow(bayerPlaneAt(planar.cfa, y, 1), i);
+
+            if (bayerImage.format == FORMAT_RAW8)
+                _merge_row(even, odd, dst, planar.planeWidth, shift);
+            else
+                _merge_row(even, odd, reinterpret_cast<uint16_t *>(dst),
+                           planar.planeWidth, shift);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file bayer_planar.h
+ *
+ * @brief split a bayer image into R/Gr/Gb/B planes and merge it back
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef BAYERPLANAR_H
+#define BAYERPLANAR_H
+
+#include "imagesignalprocessor.h"
+
+BEGIN_NAMESPACE_ISP
+
+/**
+ * @brief split a bayer image into the 4 planes of planar
+ * @details the format unpack is fused into the split, the planes hold the
+ *          lsb aligned sensor values. planar must be initialized with the
+ *          size and the cfa of the bayer image and have its buffer set.
+ * @param[in]  bayerImage
+ * @param[out] planar
+ */
+ISP_EXPORT int bayerSplitPlanes(const BayerImageData &bayerImage, BayerPlanarImageData &planar);
+
+/**
+ * @brief split the plane rows [planeRow, planeRow + planeRows) only
+ * @details the bayer rows 2 * planeRow .. 2 * (planeRow + planeRows) - 1
+ */
+ISP_EXPORT int bayerSplitPlanes(const BayerImageData &bayerImage, BayerPlanarImageData &planar,
+                                int planeRow, int planeRows);
+
+/**
+ * @brief interleave the 4 planes back into a bayer image
+ * @details the samples are packed to the format of bayerImage, whose
+ *          size must match the planes
+ * @param[in]  planar
+ * @param[out] bayerImage
+ */
+ISP_EXPORT int bayerMergePlanes(const BayerPlanarImageData &planar, BayerImageData &bayerImage);
+
+/**
+ * @brief plane holding the bayer site (row, col) of a 2x2 cfa
+ */
+ISP_EXPORT BayerPlane_e bayerPlaneAt(BayerCFAPattern_e cfa, int row, int col);
+
+END_NAMESPACE_ISP
+
+#endif // BAYERPLANAR_H
@@ -0,0 +1,427 @@
+/**
+ * @file demosaic_scheduler.cpp
+ *
+ * @brief demosaic stream scheduler implement
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include <algorithm>
+
+#include "demosaic_scheduler.h"
+#include "numa_affinity.h"
+
+ISP_USE_NAMESPACE
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* pages of a frame image sampled for the remote access counters */
+#define NUMA_SAMPLE_PAGES 16
+
+template <typename Duration>
+static double _to_ms(Duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static void _account_frame(DemosaicStreamStats &stats, double latencyMs,
+                           bool missed, uint64_t pixels)
+{
+    stats.framesCompleted++;
+    stats.pixelsProcessed += pixels;
+    if (missed)
+        stats.deadlineMisses++;
+    stats.avgLatencyMs += (latencyMs - stats.avgLatencyMs) / stats.framesCompleted;
+    stats.maxLatencyMs = MAX(stats.maxLatencyMs, latencyMs);
+}
+
+static void _account_pages(DemosaicStreamStats &stats, uint64_t localPages,
+                           uint64_t remotePages)
+{
+    stats.localPages += localPages;
+    stats.remotePages += remotePages;
+}
+
+static void _finish_stats(DemosaicStreamStats &stats)
+{
+    uint64_t pages = stats.localPages + stats.remotePages;
+
+    if (pages)
+        stats.remoteAccessRatio = static_cast<double>(stats.remotePages) / pages;
+}
+
+DemosaicScheduler::DemosaicScheduler(int threadCount, int bandHeight,
+                                     NumaPolicy numaPolicy)
+    : m_bandHeight (MAX((bandHeight + 1) & ~1, 2))
+    , m_numaPolicy (numaPolicy)
+    , m_stop (false)
+    , m_nextStreamId (0)
+    , m_nextSeq (0)
+    , m_startTime (Clock::now())
+{
+    if (threadCount <= 0)
+        threadCount = MAX(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+    /* the workers are dealt to the nodes in turn, -1 is not pinned */
+    const std::vector<int> &nodes = numaNodes();
+
+    for (int i = 0; i < threadCount; i++) {
+        int node = m_numaPolicy == NUMA_POLICY_NODE_LOCAL ? nodes[i % nodes.size()] : -1;
+
+        m_workerNodes.push_back(node);
+        m_workers.push_back(std::thread(&DemosaicScheduler::workerLoop, this, node));
+    }
+}
+
+DemosaicScheduler::~DemosaicScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+
+    for (std::thread &worker : m_workers)
+        worker.join();
+}
+
+int DemosaicScheduler::addStream(const Demosaic &demosaic, int priority, int weight,
+                                 int node)
+{
+    if (weight <= 0) {
+        std::cout << "Invalid stream weight " << weight << std::endl;
+        return -1;
+    }
+
+    bool workerNode = std::find(m_workerNodes.begin(), m_workerNodes.end(), node)
+        != m_workerNodes.end();
+
+    if (node != -1 && (numaNodeCpus(node).empty()
+        || (m_numaPolicy == NUMA_POLICY_NODE_LOCAL && !workerNode))) {
+        std::cout << "Invalid stream numa node " << node << std::endl;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stream stream;
+
+    /* balance the streams over the nodes which have workers */
+    if (node == -1 && m_numaPolicy == NUMA_POLICY_NODE_LOCAL) {
+        std::map<int, int> streamCount;
+
+        for (int workerNode : m_workerNodes)
+            streamCount[workerNode] = 0;
+        for (auto &s : m_streams)
+            streamCount[s.second.node]++;
+        for (auto &count : streamCount) {
+            if (node == -1 || count.second < streamCount[node])
+                node = count.first;
+        }
+    }
+
+    stream.demosaic = &demosaic;
+    stream.node = node;
+    stream.priority = priority;
+    stream.weight = weight;
+    stream.virtualTime = 0;
+    stream.pendingFrames = 0;
+    stream.startTime = Clock::now();
+
+    int id = m_nextStreamId++;
+    m_streams[id] = stream;
+
+    return id;
+}
+
+int DemosaicScheduler::removeStream(int streamId)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_streams.find(streamId);
+
+    if (it == m_streams.end()) {
+        std::cout << "Invalid stream " << streamId << std::endl;
+        return -1;
+    }
+    if (it->second.pendingFrames) {
+        std::cout << "Stream " << streamId << " still has "
+            << it->second.pendingFrames << " pending frames" << std::endl;
+        return -1;
+    }
+    m_streams.erase(it);
+
+    return 0;
+}
+
+int DemosaicScheduler::streamNode(int streamId) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_streams.find(streamId);
+
+    return it != m_streams.end() ? it->second.node : -1;
+}
+
+void *DemosaicScheduler::allocFrame(int streamId, size_t size) const
+{
+    return numaAlloc(size, streamNode(streamId));
+}
+
+void DemosaicScheduler::freeFrame(void *frame, size_t size) const
+{
+    numaFree(frame, size);
+}
+
+int DemosaicScheduler::setStreamPriority(int streamId, int priority, int weight)
+{
+    if (weight <= 0) {
+        std::cout << "Invalid stream weight " << weight << std::endl;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_streams.find(streamId);
+
+    if (it == m_streams.end()) {
+        std::cout << "Invalid stream " << streamId << std::endl;
+        return -1;
+    }
+    it->second.priority = priority;
+    it->second.weight = weight;
+
+    return 0;
+}
+
+std::future<int> DemosaicScheduler::submit(int streamId,
+                                           const BayerImageData &bayerImage,
+                                           const CFADescriptor &cfa,
+                                           RGBImageData &rgbImage,
+                                           int deadlineMs)
+{
+    Job *job = new Job;
+    std::future<int> future = job->promise.get_future();
+
+    job->streamId = streamId;
+    job->bayerImage = bayerImage;
+    job->cfa = cfa;
+    job->rgbImage = rgbImage;
+    job->submitTime = Clock::now();
+    job->hasDeadline = deadlineMs > 0;
+    job->deadline = job->submitTime + std::chrono::milliseconds(deadlineMs);
+    job->bandCount = (bayerImage.height + m_bandHeight - 1) / m_bandHeight;
+    job->nextBand = 0;
+    job->bandsDone = 0;
+    job->result = 0;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = m_streams.find(streamId);
+
+    if (it == m_streams.end() || job->bandCount <= 0) {
+        lock.unlock();
+        std::cout << "Invalid stream " << streamId << " or empty frame" << std::endl;
+        job->promise.set_value(-1);
+        delete job;
+        return future;
+    }
+
+    Stream &stream = it->second;
+
+    /*
+     * a stream which was idle must not catch up on the time it did not
+     * use, start it at the lowest virtual time of the busy streams
+     */
+    if (stream.pendingFrames == 0) {
+        double minVirtualTime = -1;
+
+        for (auto &s : m_streams) {
+            if (s.second.pendingFrames && (minVirtualTime < 0
+                || s.second.virtualTime < minVirtualTime))
+                minVirtualTime = s.second.virtualTime;
+        }
+        stream.virtualTime = MAX(stream.virtualTime, minVirtualTime);
+    }
+
+    stream.pendingFrames++;
+    job->seq = m_nextSeq++;
+    m_runnable.push_back(job);
+    lock.unlock();
+
+    m_cond.notify_all();
+
+    return future;
+}
+
+/* called with m_mutex held, node -1 takes the jobs of all the nodes */
+DemosaicScheduler::Job *DemosaicScheduler::pickJob(int node)
+{
+    Job *best = nullptr;
+    const Stream *bestStream = nullptr;
+
+    for (Job *job : m_runnable) {
+        const Stream &stream = m_streams[job->streamId];
+
+        if (node != -1 && stream.node != node)
+            continue;
+
+        if (best == nullptr) {
+            best = job;
+            bestStream = &stream;
+            continue;
+        }
+
+        if (stream.priority != bestStream->priority) {
+            if (stream.priority > bestStream->priority) {
+                best = job;
+                bestStream = &stream;
+            }
+            continue;
+        }
+
+        if (job->hasDeadline != best->hasDeadline) {
+            if (job->hasDeadline) {
+                best = job;
+                bestStream = &stream;
+            }
+            continue;
+        }
+        if (job->hasDeadline && job->deadline != best->deadline) {
+            if (job->deadline < best->deadline) {
+                best = job;
+                bestStream = &stream;
+            }
+            continue;
+        }
+
+        if (stream.virtualTime != bestStream->virtualTime) {
+            if (stream.virtualTime < bestStream->virtualTime) {
+                best = job;
+                bestStream = &stream;
+            }
+            continue;
+        }
+
+        if (job->seq < best->seq) {
+            best = job;
+            bestStream = &stream;
+        }
+    }
+
+    return best;
+}
+
+/* called with m_mutex held */
+void DemosaicScheduler::completeJob(Job *job)
+{
+    Stream &stream = m_streams[job->streamId];
+    Clock::time_point now = Clock::now();
+    double latencyMs = _to_ms(now - job->submitTime);
+    bool missed = job->hasDeadline && now > job->deadline;
+    uint64_t pixels = static_cast<uint64_t>(job->bayerImage.width) * job->bayerImage.height;
+
+    _account_frame(stream.stats, latencyMs, missed, pixels);
+    _account_frame(m_totalStats, latencyMs, missed, pixels);
+    stream.pendingFrames--;
+
+    job->promise.set_value(job->result);
+    delete job;
+}
+
+void DemosaicScheduler::workerLoop(int node)
+{
+    if (node != -1)
+        numaBindThread(node);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        Job *job = nullptr;
+
+        m_cond.wait(lock, [&] {
+            job = pickJob(node);
+            return m_stop || job;
+        });
+        if (job == nullptr)
+            return;
+
+        const Stream &stream = m_streams[job->streamId];
+        const Demosaic *demosaic = stream.demosaic;
+        int band = job->nextBand++;
+
+        if (job->nextBand == job->bandCount)
+            m_runnable.remove(job);
+
+        lock.unlock();
+
+        int y = band * m_bandHeight;
+        ImageRect rect(0, y, job->bayerImage.width,
+                       MIN(m_bandHeight, job->bayerImage.height - y));
+        Clock::time_point start = Clock::now();
+        int rc = demosaic->bayer2RGBRegion(job->bayerImage, job->cfa, rect, job->rgbImage);
+        double busyMs = _to_ms(Clock::now() - start);
+
+        /*
+         * where the frame lives compared to the node of the pinned
+         * worker, sampled once per frame off the band path
+         */
+        uint64_t localPages = 0;
+        uint64_t remotePages = 0;
+
+        if (node != -1 && band == 0) {
+            numaCountPages(job->bayerImage.imageData,
+                           job->bayerImage.height * job->bayerImage.stride,
+                           NUMA_SAMPLE_PAGES, node, localPages, remotePages);
+            numaCountPages(job->rgbImage.imageData,
+                           job->rgbImage.height * job->rgbImage.stride,
+                           NUMA_SAMPLE_PAGES, node, localPages, remotePages);
+        }
+
+        lock.lock();
+
+        Stream &s = m_streams[job->streamId];
+        s.stats.busyTimeMs += busyMs;
+        s.virtualTime += busyMs / s.weight;
+        m_totalStats.busyTimeMs += busyMs;
+        _account_pages(s.stats, localPages, remotePages);
+        _account_pages(m_totalStats, localPages, remotePages);
+        if (rc)
+            job->result = rc;
+
+        if (++job->bandsDone == job->bandCount)
+            completeJob(job);
+    }
+}
+
+int DemosaicScheduler::getStreamStats(int streamId, DemosaicStreamStats &stats) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_streams.find(streamId);
+
+    if (it == m_streams.end()) {
+        std::cout << "Invalid stream " << streamId << std::endl;
+        return -1;
+    }
+
+    stats = it->second.stats;
+    double elapsedMs = _to_ms(Clock::now() - it->second.startTime);
+    if (elapsedMs > 0)
+        stats.throughputFps = stats.framesCompleted * 1000.0 / elapsedMs;
+    _finish_stats(stats);
+
+    return 0;
+}
+
+DemosaicStreamStats DemosaicScheduler::getTotalStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    DemosaicStreamStats stats = m_totalStats;
+    double elapsedMs = _to_ms(Clock::now() - m_startTime);
+
+    if (elapsedMs > 0)
+        stats.throughputFps = stats.framesCompleted * 1000.0 / elapsedMs;
+    _finish_stats(stats);
+
+    return stats;
+}
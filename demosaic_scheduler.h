@@ -0,0 +1,209 @@
+/**
+ * @file demosaic_scheduler.h
+ *
+ * @brief share one worker pool between many demosaic streams
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef DEMOSAICSCHEDULER_H
+#define DEMOSAICSCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "raw_bayer_demosaic.h"
+
+BEGIN_NAMESPACE_ISP
+
+/**
+ * @brief statistics of a stream (or of all streams) of the scheduler
+ */
+struct DemosaicStreamStats {
+    uint64_t framesCompleted;   /*!< frames converted */
+    uint64_t deadlineMisses;    /*!< frames completed after their deadline */
+    uint64_t pixelsProcessed;   /*!< pixels converted */
+    double busyTimeMs;          /*!< worker time spent on the stream */
+    double avgLatencyMs;        /*!< mean submit to completion time */
+    double maxLatencyMs;        /*!< worst submit to completion time */
+    double throughputFps;       /*!< frames per second since the stream was added */
+    uint64_t localPages;        /*!< sampled frame pages on the node of the worker,
+                                     NUMA_POLICY_NODE_LOCAL only */
+    uint64_t remotePages;       /*!< sampled frame pages on another node */
+    double remoteAccessRatio;   /*!< remotePages / (localPages + remotePages) */
+
+    DemosaicStreamStats()
+        : framesCompleted (0)
+        , deadlineMisses (0)
+        , pixelsProcessed (0)
+        , busyTimeMs (0)
+        , avgLatencyMs (0)
+        , maxLatencyMs (0)
+        , throughputFps (0)
+        , localPages (0)
+        , remotePages (0)
+        , remoteAccessRatio (0)
+    {
+    }
+};
+
+/**
+ * @brief priority scheduler for concurrent demosaic streams
+ * @details every submitted frame is split into row bands, the workers
+ *          pick one band at a time, so a frame of a more urgent stream
+ *          preempts the running frames at the next band boundary.
+ *          A band is picked by, in order:
+ *          - the highest stream priority
+ *          - the earliest deadline, frames without deadline last
+ *          - the lowest fair-share virtual time (busy time / weight)
+ *          - the submission order
+ *          With NUMA_POLICY_NODE_LOCAL the workers are pinned to the
+ *          nodes in turn, every stream belongs to one node and its bands
+ *          are only run by the workers of that node. On a single node
+ *          host it behaves as NUMA_POLICY_NONE with pinned workers.
+ */
+class ISP_EXPORT DemosaicScheduler {
+
+public:
+    enum NumaPolicy {
+        NUMA_POLICY_NONE = 0,       /*!< workers float, any worker runs any stream */
+        NUMA_POLICY_NODE_LOCAL,     /*!< workers pinned, streams stay on their node */
+    };
+
+    /**
+     * @param[in] threadCount  number of workers, 0 means one per cpu
+     * @param[in] bandHeight   rows of a band, rounded up to even
+     * @param[in] numaPolicy
+     */
+    DemosaicScheduler(int threadCount = 0, int bandHeight = 64,
+                      NumaPolicy numaPolicy = NUMA_POLICY_NONE);
+
+    /**
+     * @brief complete the pending frames and stop the workers
+     */
+    ~DemosaicScheduler();
+
+    /**
+     * @brief register a stream
+     * @param[in] demosaic  converter of the stream, must outlive the stream
+     * @param[in] priority  larger is more urgent
+     * @param[in] weight    fair-share weight among streams of the same
+     *                      priority, must be positive
+     * @param[in] node      NUMA node of the stream, -1 picks the node with
+     *                      the fewest streams for NUMA_POLICY_NODE_LOCAL
+     * @return stream id, or -1 on error
+     */
+    int addStream(const Demosaic &demosaic, int priority = 0, int weight = 1,
+                  int node = -1);
+
+    /**
+     * @brief NUMA node of a stream, -1 if it has none
+     */
+    int streamNode(int streamId) const;
+
+    /**
+     * @brief allocate a frame buffer on the node of a stream
+     * @details for the bayer and RGB images of the frames of the stream,
+     *          release with freeFrame()
+     */
+    void *allocFrame(int streamId, size_t size) const;
+    void freeFrame(void *frame, size_t size) const;
+
+    /**
+     * @brief unregister a stream
+     * @return 0 on success, -1 if the stream is unknown or has pending frames
+     */
+    int removeStream(int streamId);
+
+    /**
+     * @brief change the priority and weight of a stream
+     */
+    int setStreamPriority(int streamId, int priority, int weight = 1);
+
+    /**
+     * @brief queue a frame of a stream
+     * @details the images must stay valid until the frame completes
+     * @param[in]  streamId
+     * @param[in]  bayerImage
+     * @param[in]  cfa
+     * @param[out] rgbImage
+     * @param[in]  deadlineMs  deadline relative to now, 0 means none
+     * @return future of the bayer2RGB result
+     */
+    std::future<int> submit(int streamId, const BayerImageData &bayerImage,
+                            const CFADescriptor &cfa, RGBImageData &rgbImage,
+                            int deadlineMs = 0);
+
+    /**
+     * @brief get the statistics of a stream
+     */
+    int getStreamStats(int streamId, DemosaicStreamStats &stats) const;
+
+    /**
+     * @brief get the statistics summed over all streams since creation
+     */
+    DemosaicStreamStats getTotalStats() const;
+
+    int threadCount() const { return static_cast<int>(m_workers.size()); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Stream {
+        const Demosaic *demosaic;
+        int node;
+        int priority;
+        int weight;
+        double virtualTime;     /* busy time / weight, in ms */
+        int pendingFrames;
+        Clock::time_point startTime;
+        DemosaicStreamStats stats;
+    };
+
+    struct Job {
+        int streamId;
+        uint64_t seq;
+        BayerImageData bayerImage;
+        CFADescriptor cfa;
+        RGBImageData rgbImage;
+        Clock::time_point submitTime;
+        Clock::time_point deadline;
+        bool hasDeadline;
+        int bandCount;
+        int nextBand;
+        int bandsDone;
+        int result;
+        std::promise<int> promise;
+    };
+
+    DemosaicScheduler(const DemosaicScheduler &) = delete;
+    DemosaicScheduler &operator=(const DemosaicScheduler &) = delete;
+
+    int m_bandHeight;
+    NumaPolicy m_numaPolicy;
+    std::vector<int> m_workerNodes;
+    bool m_stop;
+    int m_nextStreamId;
+    uint64_t m_nextSeq;
+    Clock::time_point m_startTime;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::map<int, Stream> m_streams;
+    std::list<Job *> m_runnable;     /* jobs with bands not yet picked */
+    DemosaicStreamStats m_totalStats;
+    std::vector<std::thread> m_workers;
+
+    Job *pickJob(int node);
+    void completeJob(Job *job);
+    void workerLoop(int node);
+};
+
+END_NAMESPACE_ISP
+
+#endif // DEMOSAICSCHEDULER_H
@@ -0,0 +1,360 @@
+/**
+ * @file demosaic_tuner.cpp
+ *
+ * @brief demosaic auto-tuner implement
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "demosaic_tuner.h"
+#include "demosaic_scheduler.h"
+#include "incremental_demosaic.h"
+#include "bayer_planar.h"
+#include "raw_denoise.h"
+
+ISP_USE_NAMESPACE
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* more threads must be this much faster to be picked */
+#define TUNE_THREAD_GAIN 0.97
+
+static const int kBandHeights[] = {16, 32, 64, 128, 256};
+static const int kTileSizes[] = {16, 32, 64, 128, 256};
+
+/* best time of repeat runs after a warm up run, in ms, -1 on error */
+template <typename Fn>
+static double _time_best(int repeat, Fn fn)
+{
+    typedef std::chrono::steady_clock Clock;
+    double best = -1;
+
+    if (fn())
+        return -1;
+
+    for (int i = 0; i < repeat; i++) {
+        Clock::time_point start = Clock::now();
+
+        if (fn())
+            return -1;
+
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        if (best < 0 || ms < best)
+            best = ms;
+    }
+
+    return best;
+}
+
+/* BayerCFAPattern_e of a 2x2 bayer descriptor, -1 for other layouts */
+static int _bayer_pattern(const CFADescriptor &cfa)
+{
+    const BayerCFAPattern_e patterns[] = {
+        BAYER_CFA_RGGB, BAYER_CFA_BGGR, BAYER_CFA_GRBG, BAYER_CFA_GBRG,
+    };
+
+    for (BayerCFAPattern_e pattern : patterns) {
+        if (cfa == CFADescriptor(pattern))
+            return pattern;
+    }
+
+    return -1;
+}
+
+DemosaicTuner::DemosaicTuner(const char *profilePath)
+    : m_repeat (3)
+{
+    const char *env = getenv("ISP_TUNING_PROFILE");
+    const char *home = getenv("HOME");
+
+    if (profilePath)
+        m_profilePath = profilePath;
+    else if (env)
+        m_profilePath = env;
+    else if (home)
+        m_profilePath = std::string(home) + "/.isp_tuning.profile";
+    else
+        m_profilePath = ".isp_tuning.profile";
+}
+
+std::string DemosaicTuner::cpuModel()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            size_t pos = line.find(':');
+
+            if (pos != std::string::npos && pos + 2 <= line.size())
+                return line.substr(pos + 2);
+        }
+    }
+
+    return "unknown";
+}
+
+std::string DemosaicTuner::profileKey(const Demosaic &demosaic, int width, int height,
+                                      RawFormat_e format, const CFADescriptor &cfa,
+                                      RGBFormat_e rgbFormat) const
+{
+    const RawDenoise *denoise = demosaic.rawDenoise();
+    static const char colors[] = "RGBW";
+    std::ostringstream key;
+
+    key << cpuModel() << ";" << std::thread::hardware_concurrency() << ";"
+        << width << "x" << height << ";" << format << ";";
+    for (int i = 0; i < cfa.period * cfa.period; i++)
+        key << colors[cfa.colors[i]];
+    key << ";" << rgbFormat << ";" << demosaic.orientation() << ";" << demosaic.lumaMode()
+        << ";" << (denoise ? denoise->rangeSigma() : 0);
+
+    return key.str();
+}
+
+int DemosaicTuner::load(const Demosaic &demosaic, int width, int height, RawFormat_e format,
+                        const CFADescriptor &cfa, RGBFormat_e rgbFormat,
+                        DemosaicTuning &tuning) const
+{
+    std::ifstream profile(m_profilePath);
+    std::string key = profileKey(demosaic, width, height, format, cfa, rgbFormat);
+    std::string line;
+
+    while (std::getline(profile, line)) {
+        size_t tab = line.find('\t');
+
+        if (tab == std::string::npos || line.compare(0, tab, key) != 0 || tab != key.size())
+            continue;
+
+        std::istringstream values(line.substr(tab + 1));
+        int planar, streaming;
+
+        values >> tuning.threadCount >> tuning.bandHeight >> tuning.tileSize
+            >> planar >> streaming;
+        if (values.fail()) {
+            std::cout << "Invalid tuning profile line " << line << std::endl;
+            return -1;
+        }
+        tuning.planar = planar != 0;
+        tuning.streamingStore = static_cast<Demosaic::StreamingStore>(streaming);
+
+        return 0;
+    }
+
+    return -1;
+}
+
+int DemosaicTuner::store(const Demosaic &demosaic, int width, int height, RawFormat_e format,
+                         const CFADescriptor &cfa, RGBFormat_e rgbFormat,
+                         const DemosaicTuning &tuning) const
+{
+    std::string key = profileKey(demosaic, width, height, format, cfa, rgbFormat) + "\t";
+    std::vector<std::string> lines;
+
+    {
+        std::ifstream profile(m_profilePath);
+        std::string line;
+
+        while (std::getline(profile, line)) {
+            if (line.compare(0, key.size(), key) != 0)
+                lines.push_back(line);
+        }
+    }
+
+    std::ostringstream entry;
+    entry << key << tuning.threadCount << " " << tuning.bandHeight << " "
+        << tuning.tileSize << " " << (tuning.planar ? 1 : 0) << " "
+        << tuning.streamingStore;
+    lines.push_back(entry.str());
+
+    /* replace the profile at once, other processes never read half of it */
+    std::string tmpPath = m_profilePath + ".tmp";
+    {
+        std::ofstream profile(tmpPath, std::ios::trunc);
+
+        for (const std::string &line : lines)
+            profile << line << "\n";
+        if (!profile) {
+            std::cout << "Fail to write " << tmpPath << std::endl;
+            return -1;
+        }
+    }
+    if (rename(tmpPath.c_str(), m_profilePath.c_str())) {
+        std::cout << "Fail to write " << m_profilePath << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+int DemosaicTuner::tune(const Demosaic &demosaic, int width, int height, RawFormat_e format,
+                        const CFADescriptor &cfa, RGBFormat_e rgbFormat,
+                        DemosaicTuning &tuning) const
+{
+    if (load(demosaic, width, height, format, cfa, rgbFormat, tuning) == 0)
+        return 0;
+
+    if (calibrate(demosaic, width, height, format, cfa, rgbFormat, tuning))
+        return -1;
+
+    /* the tuning is still usable when the profile can not be written */
+    store(demosaic, width, height, format, cfa, rgbFormat, tuning);
+
+    return 0;
+}
+
+int DemosaicTuner::calibrate(const Demosaic &settings, int width, int height,
+                             RawFormat_e format, const CFADescriptor &cfa,
+                             RGBFormat_e rgbFormat, DemosaicTuning &tuning) const
+{
+    BayerImageData bayer;
+    RGBImageData rgb;
+    ImageOrientation_e orientation = settings.orientation();
+    bool transposed = orientation == ORIENTATION_ROTATE_90
+        || orientation == ORIENTATION_ROTATE_270;
+
+    if (bayer.init(width, height, format)
+        || rgb.init(transposed ? height : width, transposed ? width : height, rgbFormat)) {
+        std::cout << "Invalid tuning geometry " << width << "x" << height << std::endl;
+        return -1;
+    }
+
+    /* synthetic frame, the kernels do not depend on the content */
+    std::vector<uint8_t> bayerData(bayer.imageSize());
+    std::vector<uint8_t> rgbData(rgb.imageSize());
+    uint32_t seed = 1;
+
+    for (uint8_t &v : bayerData) {
+        seed = seed * 1103515245 + 12345;
+        v = static_cast<uint8_t>(seed >> 16);
+    }
+    bayer.setImageData(bayerData.data());
+    rgb.setImageData(rgbData.data());
+
+    Demosaic demosaic;
+    DemosaicTuning best;
+
+    demosaic.setOrientation(orientation);
+    demosaic.setLumaMode(settings.lumaMode());
+    demosaic.setRawDenoise(settings.rawDenoise());
+    double bestMs = -1;
+
+    /* kernel and streaming store, single thread */
+    const Demosaic::StreamingStore modes[] = {
+        Demosaic::STREAMING_STORE_OFF, Demosaic::STREAMING_STORE_ON,
+    };
+    for (Demosaic::StreamingStore mode : modes) {
+        demosaic.setStreamingStore(mode);
+
+        double ms = _time_best(m_repeat, [&]() {
+            return demosaic.bayer2RGB(bayer, cfa, rgb);
+        });
+        if (ms < 0)
+            return -1;
+        if (bestMs < 0 || ms < bestMs) {
+            bestMs = ms;
+            best.streamingStore = mode;
+        }
+    }
+
+    /* planar2RGB() has no raw denoise */
+    int pattern = settings.rawDenoise() ? -1 : _bayer_pattern(cfa);
+    BayerPlanarImageData planar;
+
+    if (pattern >= 0
+        && planar.init(width, height, static_cast<BayerCFAPattern_e>(pattern)) == 0) {
+        std::vector<uint8_t> planarData(planar.imageSize());
+
+        planar.setImageData(planarData.data());
+
+        double ms = _time_best(m_repeat, [&]() {
+            int rc = bayerSplitPlanes(bayer, planar);
+
+            return rc ? rc : demosaic.planar2RGB(planar, rgb);
+        });
+        if (ms >= 0 && ms < bestMs)
+            best.planar = true;
+    }
+
+    /* thread count x band height */
+    demosaic.setStreamingStore(best.streamingStore);
+
+    int maxThreads = MAX(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    std::vector<int> threadCounts;
+
+    for (int threads = 1; threads < maxThreads; threads *= 2)
+        threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    bestMs = -1;
+    for (int threads : threadCounts) {
+        for (int bandHeight : kBandHeights) {
+            DemosaicScheduler scheduler(threads, bandHeight);
+            int streamId = scheduler.addStream(demosaic);
+
+            double ms = _time_best(m_repeat, [&]() {
+                return scheduler.submit(streamId, bayer, cfa, rgb).get();
+            });
+            if (ms < 0)
+                return -1;
+            if (bestMs < 0 || ms < bestMs * (threads > best.threadCount ? TUNE_THREAD_GAIN : 1.0)) {
+                bestMs = ms;
+                best.threadCount = threads;
+                best.bandHeight = bandHeight;
+            }
+        }
+    }
+
+    /* incremental tile size, a block of 1/8 x 1/8 of the frame moves */
+    std::vector<uint8_t> movingData(bayerData);
+    BayerImageData moving = bayer;
+    int blockWidth = MAX(width / 8, 1);
+    int blockHeight = MAX(height / 8, 1);
+    int bytes = format == FORMAT_RAW8 ? 1 : 2;
+    std::vector<ImageRect> dirtyRects;
+
+    moving.setImageData(movingData.data());
+    bestMs = -1;
+    for (int tileSize : kTileSizes) {
+        IncrementalDemosaic incremental(demosaic, tileSize);
+        int frame = 0;
+
+        double ms = _time_best(m_repeat, [&]() {
+            int x = (frame * width / 5) % MAX(width - blockWidth, 1);
+            int y = (frame * height / 7) % MAX(height - blockHeight, 1);
+
+            for (int row = y; row < y + blockHeight; row++) {
+                uint8_t *p = movingData.data() + row * bayer.stride + x * bytes;
+
+                for (int i = 0; i < blockWidth * bytes; i++)
+                    p[i] ^= 0xff;
+            }
+            frame++;
+
+            return incremental.bayer2RGB(moving, cfa, rgb, dirtyRects);
+        });
+        if (ms < 0)
+            return -1;
+        if (bestMs < 0 || ms < bestMs) {
+            bestMs = ms;
+            best.tileSize = tileSize;
+        }
+    }
+
+    tuning = best;
+
+    return 0;
+}
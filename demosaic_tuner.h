@@ -0,0 +1,111 @@
+/**
+ * @file demosaic_tuner.h
+ *
+ * @brief calibrate the demosaic configuration for the running machine
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef DEMOSAICTUNER_H
+#define DEMOSAICTUNER_H
+
+#include <string>
+
+#include "raw_bayer_demosaic.h"
+
+BEGIN_NAMESPACE_ISP
+
+/**
+ * @brief demosaic configuration picked by DemosaicTuner
+ */
+struct DemosaicTuning {
+    int threadCount;    /*!< DemosaicScheduler / parallelForBands threads */
+    int bandHeight;     /*!< DemosaicScheduler / parallelForBands band rows */
+    int tileSize;       /*!< IncrementalDemosaic tile size */
+    bool planar;        /*!< bayerSplitPlanes() + planar2RGB() beat bayer2RGB(),
+                             never set when the demosaic has a raw denoise */
+    Demosaic::StreamingStore streamingStore;    /*!< for Demosaic::setStreamingStore() */
+
+    DemosaicTuning()
+        : threadCount (0)
+        , bandHeight (64)
+        , tileSize (64)
+        , planar (false)
+        , streamingStore (Demosaic::STREAMING_STORE_AUTO)
+    {
+    }
+};
+
+/**
+ * @brief auto-tuner of the demosaic configuration
+ * @details times the candidate configurations on a synthetic frame of
+ *          the requested geometry and keeps the fastest one:
+ *          - kernel (interleaved or planar) and streaming store, single thread
+ *          - thread count x band height, with a DemosaicScheduler
+ *          - IncrementalDemosaic tile size, with a small moving change
+ *          The candidates run with the orientation, luma mode and raw
+ *          denoise of the caller's Demosaic. The result is stored in a
+ *          text profile keyed by the cpu model, the cpu count, the
+ *          geometry and these settings, tune() loads it on the next
+ *          process start instead of calibrating again.
+ */
+class ISP_EXPORT DemosaicTuner {
+
+public:
+    /**
+     * @param[in] profilePath  nullptr means $ISP_TUNING_PROFILE, or
+     *                         $HOME/.isp_tuning.profile
+     */
+    DemosaicTuner(const char *profilePath = nullptr);
+
+    /**
+     * @brief timed runs of each candidate, the best one counts, default 3
+     */
+    void setRepeat(int repeat) { m_repeat = repeat; }
+
+    const std::string &profilePath() const { return m_profilePath; }
+
+    /**
+     * @brief load the tuning of the geometry, calibrate and store it if
+     *        the profile has none
+     * @param[in] demosaic  the configured demosaic, its streaming store
+     *                      is not used
+     */
+    int tune(const Demosaic &demosaic, int width, int height, RawFormat_e format,
+             const CFADescriptor &cfa, RGBFormat_e rgbFormat, DemosaicTuning &tuning) const;
+
+    /**
+     * @brief time the candidates and return the fastest configuration
+     */
+    int calibrate(const Demosaic &demosaic, int width, int height, RawFormat_e format,
+                  const CFADescriptor &cfa, RGBFormat_e rgbFormat, DemosaicTuning &tuning) const;
+
+    /**
+     * @return 0 if the profile has a tuning for the geometry, -1 otherwise
+     */
+    int load(const Demosaic &demosaic, int width, int height, RawFormat_e format,
+             const CFADescriptor &cfa, RGBFormat_e rgbFormat, DemosaicTuning &tuning) const;
+
+    /**
+     * @brief add or replace the tuning of the geometry in the profile
+     */
+    int store(const Demosaic &demosaic, int width, int height, RawFormat_e format,
+              const CFADescriptor &cfa, RGBFormat_e rgbFormat,
+              const DemosaicTuning &tuning) const;
+
+    /**
+     * @brief cpu model name of /proc/cpuinfo, "unknown" if not found
+     */
+    static std::string cpuModel();
+
+private:
+    std::string m_profilePath;
+    int m_repeat;
+
+    std::string profileKey(const Demosaic &demosaic, int width, int height,
+                           RawFormat_e format, const CFADescriptor &cfa,
+                           RGBFormat_e rgbFormat) const;
+};
+
+END_NAMESPACE_ISP
+
+#endif // DEMOSAICTUNER_H
@@ -0,0 +1,168 @@
+/**
+ * @file hdr_merge.cpp
+ *
+ * @brief multi exposure HDR merge implement
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include <algorithm>
+#include <vector>
+
+#include "hdr_merge.h"
+#include "parallel_bands.h"
+
+ISP_USE_NAMESPACE
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* per frame constants of the merge */
+struct HdrFrame {
+    const uint8_t *data;
+    int stride;
+    float scale;            /* to the output scale of the longest exposure radiance */
+    float exposureWeight;   /* exposure relative to the longest one */
+};
+
+/*
+ * accumulate one frame row, simple unit stride loop over the row so it
+ * is vectorized, the weights and sums stay in row buffers in L1
+ */
+template <typename T>
+static void _accumulate_row(const T *src, int width, int unpackShift,
+                            float fullScale, float invKneeRange,
+                            const HdrFrame &frame, float *acc, float *weightSum)
+{
+    for (int x = 0; x < width; x++) {
+        float v = static_cast<float>(src[x] >> unpackShift);
+        float w = MIN(MAX((fullScale - v) * invKneeRange, 0.0f), 1.0f) * frame.exposureWeight;
+
+        acc[x] += w * v * frame.scale;
+        weightSum[x] += w;
+    }
+}
+
+template <typename T>
+static void _fallback_row(const T *src, int width, int unpackShift,
+                          const HdrFrame &frame, float *fallback)
+{
+    for (int x = 0; x < width; x++)
+        fallback[x] = static_cast<float>(src[x] >> unpackShift) * frame.scale;
+}
+
+HdrMerge::HdrMerge()
+    : m_threadCount (0)
+    , m_bandHeight (64)
+    , m_knee (0.9f)
+{
+}
+
+int HdrMerge::merge(const BayerImageData *frames, const float *exposures, int count,
+                    BayerImageData &output) const
+{
+    if (count < 1 || count > HDR_MAX_FRAMES) {
+        std::cout << "Invalid HDR frame count " << count << std::endl;
+        return -1;
+    }
+
+    const BayerImageData &first = frames[0];
+    int bits = rawFormatBits(first.format);
+
+    if (bits < 0) {
+        std::cout << "Invalid bayer mem format " << first.format << std::endl;
+        return -1;
+    }
+    if (output.format != FORMAT_RAW16 || output.width != first.width
+        || output.height != first.height || output.imageData == nullptr) {
+        std::cout << "HDR output must be a RAW16 image of "
+            << first.width << "x" << first.height << std::endl;
+        return -1;
+    }
+
+    float maxExposure = 0;
+    float minExposure = 0;
+    int shortest = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (frames[i].width != first.width || frames[i].height != first.height
+            || frames[i].format != first.format || frames[i].imageData == nullptr) {
+            std::cout << "HDR frame " << i << " does not match frame 0" << std::endl;
+            return -1;
+        }
+        if (exposures[i] <= 0) {
+            std::cout << "Invalid HDR exposure " << exposures[i] << std::endl;
+            return -1;
+        }
+        maxExposure = MAX(maxExposure, exposures[i]);
+        if (i == 0 || exposures[i] < minExposure) {
+            minExposure = exposures[i];
+            shortest = i;
+        }
+    }
+
+    int unpackShift = rawFormatUnpackShift(first.format);
+    float fullScale = static_cast<float>((1 << bits) - 1);
+    float invKneeRange = 1.0f / MAX((1.0f - m_knee) * fullScale, 1.0f);
+
+    /* full scale of the shortest exposure maps to 65535 */
+    float gain = 65535.0f / (fullScale * (maxExposure / minExposure));
+
+    HdrFrame params[HDR_MAX_FRAMES];
+    for (int i = 0; i < count; i++) {
+        params[i].data = reinterpret_cast<const uint8_t *>(frames[i].imageData);
+        params[i].stride = frames[i].stride;
+        params[i].scale = maxExposure / exposures[i] * gain;
+        params[i].exposureWeight = exposures[i] / maxExposure;
+    }
+
+    int width = first.width;
+    bool raw8 = first.format == FORMAT_RAW8;
+
+    return parallelForBands(first.height, m_bandHeight, m_threadCount,
+                            [&](int y0, int rows) -> int {
+        std::vector<float> buf(3 * width);
+        float *acc = buf.data();
+        float *weightSum = acc + width;
+        float *fallback = weightSum + width;
+
+        for (int y = y0; y < y0 + rows; y++) {
+            std::fill(buf.begin(), buf.begin() + 2 * width, 0.0f);
+
+            for (int i = 0; i < count; i++) {
+                const uint8_t *src = params[i].data + y * params[i].stride;
+
+                if (raw8)
+                    _accumulate_row(src, width, unpackShift, fullScale,
+                                    invKneeRange, params[i], acc, weightSum);
+                else
+                    _accumulate_row(reinterpret_cast<const uint16_t *>(src), width,
+                                    unpackShift, fullScale, invKneeRange,
+                                    params[i], acc, weightSum);
+            }
+
+            /* all the frames saturated: keep the shortest exposure */
+            const uint8_t *src = params[shortest].data + y * params[shortest].stride;
+            if (raw8)
+                _fallback_row(src, width, unpackShift, params[shortest], fallback);
+            else
+                _fallback_row(reinterpret_cast<const uint16_t *>(src), width,
+                              unpackShift, params[shortest], fallback);
+
+            uint16_t *dst = reinterpret_cast<uint16_t *>(
+                reinterpret_cast<uint8_t *>(output.imageData) + y * output.stride);
+
+            for (int x = 0; x < width; x++) {
+                float v = weightSum[x] > 0 ? acc[x] / weightSum[x] : fallback[x];
+
+                dst[x] = static_cast<uint16_t>(MIN(v + 0.5f, 65535.0f));
+            }
+        }
+
+        return 0;
+    });
+}
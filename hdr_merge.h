@@ -0,0 +1,67 @@
+/**
+ * @file hdr_merge.h
+ *
+ * @brief merge bracketed raw exposures into one high dynamic range raw
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef HDRMERGE_H
+#define HDRMERGE_H
+
+#include "imagesignalprocessor.h"
+
+BEGIN_NAMESPACE_ISP
+
+#define HDR_MAX_FRAMES 4
+
+/**
+ * @brief raw domain multi exposure HDR merge
+ * @details every output sample is the weighted mean of the samples of the
+ *          frames scaled to the radiance of the longest exposure. The
+ *          weight of a sample is its exposure (shot noise SNR) times a
+ *          saturation hat: 1 below the knee, falling linearly to 0 at
+ *          full scale. The result is scaled so that the full scale of the
+ *          shortest exposure is 65535 and written as RAW16, which
+ *          Demosaic::bayer2RGB() reads directly, the merge needs no float
+ *          image. The rows are merged in parallel bands.
+ */
+class ISP_EXPORT HdrMerge {
+
+public:
+    HdrMerge();
+
+    /**
+     * @brief threads used by merge(), 0 (default) means one per cpu
+     */
+    void setThreadCount(int threadCount) { m_threadCount = threadCount; }
+
+    /**
+     * @brief rows of a band of the parallel merge
+     */
+    void setBandHeight(int bandHeight) { m_bandHeight = bandHeight; }
+
+    /**
+     * @brief fraction of the full scale above which a sample is considered
+     *        close to saturation, default 0.9
+     */
+    void setSaturationKnee(float knee) { m_knee = knee; }
+
+    /**
+     * @brief merge the bracketed frames
+     * @param[in]  frames     raw frames of the same size, format and cfa
+     * @param[in]  exposures  relative exposure (time x gain) of each frame
+     * @param[in]  count      number of frames, 1 to HDR_MAX_FRAMES
+     * @param[out] output     FORMAT_RAW16 image of the size of the frames
+     */
+    int merge(const BayerImageData *frames, const float *exposures, int count,
+              BayerImageData &output) const;
+
+private:
+    int m_threadCount;
+    int m_bandHeight;
+    float m_knee;
+};
+
+END_NAMESPACE_ISP
+
+#endif // HDRMERGE_H
@@ -9,6 +9,8 @@
 #define IMAGESIGNALPROCESSOR_H
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 
 #define BEGIN_NAMESPACE_ISP namespace ImageSignalProcessor {
@@ -17,6 +19,13 @@
 
 #define ISP_USE_NAMESPACE using namespace ImageSignalProcessor;
 
+/* symbols of the library API, the release build hides all the others */
+#if defined(__GNUC__)
+#define ISP_EXPORT __attribute__((visibility("default")))
+#else
+#define ISP_EXPORT
+#endif
+
 
 BEGIN_NAMESPACE_ISP
 
@@ -30,6 +39,133 @@ enum BayerCFAPattern_e {
     BAYER_CFA_GBRG,
 };
 
+/**
+ * @brief color of a color filter array site
+ */
+enum CFAColor_e {
+    CFA_COLOR_R = 0,
+    CFA_COLOR_G,
+    CFA_COLOR_B,
+    CFA_COLOR_W,    /*!< white (panchromatic) */
+};
+
+#define CFA_MAX_PERIOD 6
+
+/**
+ * @brief describe a periodic color filter array
+ * @details the colors of a period x period tile, repeated over the image,
+ *          e.g. 2x2 bayer, 4x4 quad bayer or RGBW, 6x6 X-Trans
+ */
+struct CFADescriptor {
+    int period;       /*!< width and height of the repeated tile */
+    CFAColor_e colors[CFA_MAX_PERIOD * CFA_MAX_PERIOD]; /*!< row major tile colors */
+
+    CFADescriptor()
+        : CFADescriptor(BAYER_CFA_RGGB)
+    {
+    }
+
+    CFADescriptor(BayerCFAPattern_e cfa)
+        : period (2)
+    {
+        switch (cfa) {
+        case BAYER_CFA_BGGR:
+            init("BGGR");
+            break;
+        case BAYER_CFA_GRBG:
+            init("GRBG");
+            break;
+        case BAYER_CFA_GBRG:
+            init("GBRG");
+            break;
+        case BAYER_CFA_RGGB:
+        default:
+            init("RGGB");
+            break;
+        }
+    }
+
+    /**
+     * @brief init from the row major colors of the tile
+     * @param[in] pattern  string of R, G, B, W, the length must be
+     *                     period * period, e.g. "RGGB" or
+     *                     "RRGGRRGGGGBBGGBB" (quad bayer)
+     */
+    int init(const char *pattern) {
+        int len = static_cast<int>(strlen(pattern));
+        int p = 2;
+
+        while (p < CFA_MAX_PERIOD && p * p < len)
+            p++;
+        if (p * p != len) {
+            std::cout << "Invalid CFA pattern " << pattern << std::endl;
+            return -1;
+        }
+
+        /* parse first, the descriptor is left untouched on error */
+        CFAColor_e tile[CFA_MAX_PERIOD * CFA_MAX_PERIOD];
+        for (int i = 0; i < len; i++) {
+            switch (pattern[i]) {
+            case 'R':
+                tile[i] = CFA_COLOR_R;
+                break;
+            case 'G':
+                tile[i] = CFA_COLOR_G;
+                break;
+            case 'B':
+                tile[i] = CFA_COLOR_B;
+                break;
+            case 'W':
+                tile[i] = CFA_COLOR_W;
+                break;
+            default:
+                std::cout << "Invalid CFA color " << pattern[i] << std::endl;
+                return -1;
+            }
+        }
+        for (int i = 0; i < len; i++)
+            colors[i] = tile[i];
+        period = p;
+
+        return 0;
+    }
+
+    /**
+     * @brief init a quad bayer tile, each color of cfa covers 2x2 pixels
+     */
+    int initQuadBayer(BayerCFAPattern_e cfa) {
+        CFADescriptor bayer(cfa);
+
+        period = 4;
+        for (int row = 0; row < 4; row++)
+            for (int col = 0; col < 4; col++)
+                colors[row * 4 + col] = bayer.colorAt(row / 2, col / 2);
+
+        return 0;
+    }
+
+    /**
+     * @brief color at the image position (row, col)
+     */
+    CFAColor_e colorAt(int row, int col) const {
+        return colors[(row % period) * period + col % period];
+    }
+
+    bool operator==(const CFADescriptor &other) const {
+        if (period != other.period)
+            return false;
+        for (int i = 0; i < period * period; i++) {
+            if (colors[i] != other.colors[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool operator!=(const CFADescriptor &other) const {
+        return !(*this == other);
+    }
+};
+
 /**
  * @brief raw image format in memory
  */
@@ -41,6 +177,40 @@ enum RawFormat_e {
     FORMAT_RAW16,
 };
 
+/**
+ * @brief significant bits of the samples of a raw format
+ * @return -1 for an invalid format
+ */
+inline int rawFormatBits(RawFormat_e format)
+{
+    switch (format) {
+    case FORMAT_RAW8:
+        return 8;
+    case FORMAT_RAW10_UNPACKED:
+        return 10;
+    case FORMAT_RAW12_UNPACKED:
+        return 12;
+    case FORMAT_RAW14_UNPACKED:
+        return 14;
+    case FORMAT_RAW16:
+        return 16;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief right shift from the stored word to the sample value
+ * @details the unpacked formats are msb aligned in 16 bits, 0 for RAW8,
+ *          RAW16 and the invalid formats
+ */
+inline int rawFormatUnpackShift(RawFormat_e format)
+{
+    int bits = rawFormatBits(format);
+
+    return format == FORMAT_RAW8 || bits < 0 ? 0 : 16 - bits;
+}
+
 /**
  * @brief describe the bayer image data
  */
@@ -93,16 +263,134 @@ struct BayerImageData {
     }
 };
 
+/**
+ * @brief color planes of a quad split bayer image
+ */
+enum BayerPlane_e {
+    BAYER_PLANE_R = 0,
+    BAYER_PLANE_GR,     /*!< G sites on the R rows */
+    BAYER_PLANE_GB,     /*!< G sites on the B rows */
+    BAYER_PLANE_B,
+    BAYER_PLANE_COUNT,
+};
+
+/**
+ * @brief describe a 2x2 bayer image split into 4 half resolution planes
+ * @details each plane holds the samples of one CFA site, 16 bit, lsb
+ *          aligned (already unpacked), so every color can be read with
+ *          unit stride. Width and height of the bayer image must be even.
+ */
+struct BayerPlanarImageData {
+    int width;        /*!< bayer image width */
+    int height;       /*!< bayer image height */
+    int planeWidth;   /*!< width of a plane, width / 2 */
+    int planeHeight;  /*!< height of a plane, height / 2 */
+    int stride;       /*!< plane stride for each row, in bytes */
+    int bits;         /*!< valid bits of a sample */
+    BayerCFAPattern_e cfa; /*!< layout the planes were split from */
+
+    uint16_t *planes[BAYER_PLANE_COUNT]; /*!< point to the plane data */
+
+    BayerPlanarImageData()
+        : width (0)
+        , height (0)
+        , planeWidth (0)
+        , planeHeight (0)
+        , stride (0)
+        , bits (0)
+        , cfa (BAYER_CFA_RGGB)
+    {
+        for (int i = 0; i < BAYER_PLANE_COUNT; i++)
+            planes[i] = nullptr;
+    }
+
+    /**
+     * @brief size of the buffer holding the 4 planes
+     */
+    size_t imageSize() { return BAYER_PLANE_COUNT * planeHeight * stride; }
+
+    int init(int w, int h, BayerCFAPattern_e c) {
+        if (w <= 0 || h <= 0 || (w & 1) || (h & 1)) {
+            std::cout << "Invalid planar size " << w << "x" << h << std::endl;
+            return -1;
+        }
+        width = w;
+        height = h;
+        planeWidth = w / 2;
+        planeHeight = h / 2;
+        stride = planeWidth * 2;
+        cfa = c;
+
+        return 0;
+    }
+
+    /**
+     * @brief set the buffer of imageSize() bytes holding the 4 planes
+     */
+    void setImageData(void *data) {
+        uint8_t *p = reinterpret_cast<uint8_t *>(data);
+
+        for (int i = 0; i < BAYER_PLANE_COUNT; i++)
+            planes[i] = reinterpret_cast<uint16_t *>(p + i * planeHeight * stride);
+    }
+
+    uint16_t *planeRow(int plane, int row) const {
+        return reinterpret_cast<uint16_t *>(reinterpret_cast<uint8_t *>(planes[plane])
+                                            + row * stride);
+    }
+};
+
+/**
+ * @brief orientation of the output image relative to the sensor
+ */
+enum ImageOrientation_e {
+    ORIENTATION_NORMAL = 0,
+    ORIENTATION_ROTATE_90,    /*!< rotate 90 degrees clockwise */
+    ORIENTATION_ROTATE_180,   /*!< rotate 180 degrees */
+    ORIENTATION_ROTATE_270,   /*!< rotate 270 degrees clockwise */
+    ORIENTATION_MIRROR_H,     /*!< mirror left and right */
+    ORIENTATION_MIRROR_V,     /*!< flip top and bottom */
+};
+
+/**
+ * @brief a rectangle area inside an image, in pixels
+ */
+struct ImageRect {
+    int x;            /*!< left column */
+    int y;            /*!< top row */
+    int width;        /*!< width in pixels */
+    int height;       /*!< height in pixels */
+
+    ImageRect()
+        : x (0)
+        , y (0)
+        , width (0)
+        , height (0)
+    {
+    }
+
+    ImageRect(int _x, int _y, int w, int h)
+        : x (_x)
+        , y (_y)
+        , width (w)
+        , height (h)
+    {
+    }
+};
+
 enum RGBFormat_e {
     FORMAT_RGB32,   /*!< The image is stored using a 32-bit RGB format (0xffRRGGBB). */
     FORMAT_ARGB32,  /*!< The image is stored using a 32-bit ARGB format (0xAARRGGBB). */
     FORMAT_RGB888,  /*!< The image is stored using a 24-bit RGB format (8-8-8). */
-    FORMAT_RGBA8888 /*!< The image is stored using a 32-bit byte-ordered RGBA format (8-8-8-8).
+    FORMAT_RGBA8888,/*!< The image is stored using a 32-bit byte-ordered RGBA format (8-8-8-8).
                          Unlike ARGB32 this is a byte-ordered format,
                          which means the 32bit encoding differs between big endian and little endian
                          architectures, being respectively (0xRRGGBBAA) and (0xAABBGGRR).
                          The order of the colors is the same on any architecture
                          if read as bytes 0xRR,0xGG,0xBB,0xAA. */
+    FORMAT_GRAY8,   /*!< The image is stored using a 8-bit luma (grayscale) format. */
+    FORMAT_GRAY16,  /*!< The image is stored using a 16-bit luma (grayscale) format,
+                         the sensor bits are msb aligned. */
 };
 
 /**
@@ -139,6 +427,12 @@ struct RGBImageData {
         case FORMAT_RGB888:
             s = w * 3;
             break;
+        case FORMAT_GRAY8:
+            s = w;
+            break;
+        case FORMAT_GRAY16:
+            s = w * 2;
+            break;
         default:
             std::cout << "Invalid format " << f << std::endl;
             return -1;
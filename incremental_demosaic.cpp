@@ -0,0 +1,268 @@
+/**
+ * @file incremental_demosaic.cpp
+ *
+ * @brief incremental (dirty tile) demosaic implement
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include <cstring>
+#include <cstdlib>
+
+#include "incremental_demosaic.h"
+#include "raw_denoise.h"
+
+ISP_USE_NAMESPACE
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* the bilinear interpolation reads up to 2 pixels around the output pixel */
+#define DEMOSAIC_HALO 2
+
+static int _bytes_per_sample(RawFormat_e format)
+{
+    return format == FORMAT_RAW8 ? 1 : 2;
+}
+
+/* true if any sample of the row differs by more than threshold */
+template <typename T>
+static bool _row_changed(const T *cur, const T *prev, int count, int threshold)
+{
+    int maxDiff = 0;
+
+    /* no early exit, keep the loop simple so it is vectorized */
+    for (int i = 0; i < count; i++) {
+        int diff = abs(static_cast<int>(cur[i]) - static_cast<int>(prev[i]));
+
+        maxDiff = MAX(maxDiff, diff);
+    }
+
+    return maxDiff > threshold;
+}
+
+IncrementalDemosaic::IncrementalDemosaic(const Demosaic &demosaic, int tileSize)
+    : m_demosaic (demosaic)
+    , m_tileSize (MAX(tileSize, 2))
+    , m_threshold (0)
+    , m_prevFrame (nullptr)
+    , m_prevFrameSize (0)
+    , m_valid (false)
+    , m_prevOrientation (ORIENTATION_NORMAL)
+    , m_prevLumaMode (Demosaic::LUMA_WEIGHTED)
+    , m_prevDenoise (nullptr)
+    , m_prevDenoiseSigma (0)
+{
+}
+
+IncrementalDemosaic::~IncrementalDemosaic()
+{
+    delete [] m_prevFrame;
+}
+
+void IncrementalDemosaic::reset()
+{
+    m_valid = false;
+}
+
+bool IncrementalDemosaic::isSameStream(const BayerImageData &bayerImage,
+                                       const CFADescriptor &cfa,
+                                       const RGBImageData &rgbImage) const
+{
+    return m_valid
+        && m_prevCfa == cfa
+        && m_prevOrientation == m_demosaic.orientation()
+        && m_prevLumaMode == m_demosaic.lumaMode()
+        && m_prevDenoise == m_demosaic.rawDenoise()
+        && (m_prevDenoise == nullptr
+            || m_prevDenoiseSigma == m_prevDenoise->rangeSigma())
+        && m_prevBayer.width == bayerImage.width
+        && m_prevBayer.height == bayerImage.height
+        && m_prevBayer.format == bayerImage.format
+        && m_prevRGB.imageData == rgbImage.imageData
+        && m_prevRGB.width == rgbImage.width
+        && m_prevRGB.height == rgbImage.height
+        && m_prevRGB.stride == rgbImage.stride
+        && m_prevRGB.format == rgbImage.format;
+}
+
+bool IncrementalDemosaic::tileChanged(const BayerImageData &bayerImage,
+                                      const ImageRect &tile) const
+{
+    int bps = _bytes_per_sample(bayerImage.format);
+    int prevStride = bayerImage.width * bps;
+    int threshold = m_threshold << rawFormatUnpackShift(bayerImage.format);
+
+    for (int row = tile.y; row < tile.y + tile.height; row++) {
+        const uint8_t *cur = reinterpret_cast<const uint8_t *>(bayerImage.imageData)
+            + row * bayerImage.stride + tile.x * bps;
+        const uint8_t *prev = m_prevFrame + row * prevStride + tile.x * bps;
+
+        if (threshold == 0) {
+            /* libc memcmp is already simd optimized */
+            if (memcmp(cur, prev, tile.width * bps) != 0)
+                return true;
+        } else if (bps == 1) {
+            if (_row_changed(cur, prev, tile.width, threshold))
+                return true;
+        } else {
+            if (_row_changed(reinterpret_cast<const uint16_t *>(cur),
+                             reinterpret_cast<const uint16_t *>(prev),
+                             tile.width, threshold))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+void IncrementalDemosaic::storeTile(const BayerImageData &bayerImage,
+                                    const ImageRect &tile)
+{
+    int bps = _bytes_per_sample(bayerImage.format);
+    int prevStride = bayerImage.width * bps;
+
+    for (int row = tile.y; row < tile.y + tile.height; row++) {
+        const uint8_t *cur = reinterpret_cast<const uint8_t *>(bayerImage.imageData)
+            + row * bayerImage.stride + tile.x * bps;
+
+        memcpy(m_prevFrame + row * prevStride + tile.x * bps, cur, tile.width * bps);
+    }
+}
+
+int IncrementalDemosaic::bayer2RGB(const BayerImageData &bayerImage,
+                                   const CFADescriptor &cfa,
+                                   RGBImageData &rgbImage,
+                                   std::vector<ImageRect> &dirtyRects)
+{
+    ImageRect frame(0, 0, bayerImage.width, bayerImage.height);
+    int rc;
+
+    dirtyRects.clear();
+
+    if (!isSameStream(bayerImage, cfa, rgbImage)) {
+        size_t frameSize = static_cast<size_t>(bayerImage.width)
+            * bayerImage.height * _bytes_per_sample(bayerImage.format);
+
+        m_valid = false;
+
+        rc = m_demosaic.bayer2RGB(bayerImage, cfa, rgbImage);
+        if (rc)
+            return rc;
+
+        if (frameSize != m_prevFrameSize) {
+            delete [] m_prevFrame;
+            m_prevFrame = new uint8_t[frameSize];
+            m_prevFrameSize = frameSize;
+        }
+        storeTile(bayerImage, frame);
+
+        m_prevBayer = bayerImage;
+        m_prevCfa = cfa;
+        m_prevOrientation = m_demosaic.orientation();
+        m_prevLumaMode = m_demosaic.lumaMode();
+        m_prevDenoise = m_demosaic.rawDenoise();
+        m_prevDenoiseSigma = m_prevDenoise ? m_prevDenoise->rangeSigma() : 0;
+        m_prevRGB = rgbImage;
+        m_valid = true;
+
+        dirtyRects.push_back(m_demosaic.outputRect(frame, bayerImage.width,
+                                                   bayerImage.height));
+        return 0;
+    }
+
+    /*
+     * collect the dirty tiles, the consecutive dirty tiles of a tile row
+     * are merged into one run, and a run with the same columns as a run
+     * of the previous tile row extends that one downwards
+     */
+    std::vector<ImageRect> runs;
+    std::vector<int> openRuns, nextOpenRuns;
+    int tileCols = (bayerImage.width + m_tileSize - 1) / m_tileSize;
+
+    for (int y = 0; y < bayerImage.height; y += m_tileSize) {
+        int tileHeight = MIN(m_tileSize, bayerImage.height - y);
+
+        nextOpenRuns.clear();
+
+        /* one step past the last tile column closes the open run */
+        int runStart = -1;
+        for (int i = 0; i <= tileCols; i++) {
+            int x = i * m_tileSize;
+            bool dirty = false;
+
+            if (i < tileCols) {
+                ImageRect tile(x, y, MIN(m_tileSize, bayerImage.width - x), tileHeight);
+
+                dirty = tileChanged(bayerImage, tile);
+                if (dirty)
+                    storeTile(bayerImage, tile);
+            }
+
+            if (dirty && runStart < 0) {
+                runStart = x;
+            } else if (!dirty && runStart >= 0) {
+                int runEnd = MIN(x, bayerImage.width);
+                int merged = -1;
+
+                for (int idx : openRuns) {
+                    if (runs[idx].x == runStart
+                        && runs[idx].x + runs[idx].width == runEnd) {
+                        merged = idx;
+                        break;
+                    }
+                }
+
+                if (merged >= 0) {
+                    runs[merged].height += tileHeight;
+                } else {
+                    merged = static_cast<int>(runs.size());
+                    runs.push_back(ImageRect(runStart, y, runEnd - runStart, tileHeight));
+                }
+                nextOpenRuns.push_back(merged);
+                runStart = -1;
+            }
+        }
+
+        openRuns.swap(nextOpenRuns);
+    }
+
+    /* a fused denoise spreads a change to the samples one CFA period away */
+    int halo = DEMOSAIC_HALO + (m_demosaic.rawDenoise() ? cfa.period : 0);
+
+    for (const ImageRect &run : runs) {
+        int x0 = MAX(run.x - halo, 0);
+        int y0 = MAX(run.y - halo, 0);
+        int x1 = MIN(run.x + run.width + halo, bayerImage.width);
+        int y1 = MIN(run.y + run.height + halo, bayerImage.height);
+
+        /*
+         * the border pixels read the sites one CFA period inside, which
+         * is further than the halo for the 4x4 and larger layouts
+         */
+        if (x0 < cfa.period)
+            x0 = 0;
+        if (y0 < cfa.period)
+            y0 = 0;
+        if (x1 > bayerImage.width - cfa.period)
+            x1 = bayerImage.width;
+        if (y1 > bayerImage.height - cfa.period)
+            y1 = bayerImage.height;
+
+        ImageRect rect(x0, y0, x1 - x0, y1 - y0);
+
+        rc = m_demosaic.bayer2RGBRegion(bayerImage, cfa, rect, rgbImage);
+        if (rc) {
+            m_valid = false;
+            return rc;
+        }
+        dirtyRects.push_back(m_demosaic.outputRect(rect, bayerImage.width,
+                                                   bayerImage.height));
+    }
+
+    return 0;
+}
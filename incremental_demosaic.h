@@ -0,0 +1,93 @@
+/**
+ * @file incremental_demosaic.h
+ *
+ * @brief incremental (dirty tile) demosaic for mostly static video streams
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef INCREMENTALDEMOSAIC_H
+#define INCREMENTALDEMOSAIC_H
+
+#include <vector>
+
+#include "raw_bayer_demosaic.h"
+
+BEGIN_NAMESPACE_ISP
+
+/**
+ * @brief stateful demosaic which only refreshes the changed tiles
+ * @details every frame is compared tile by tile with the previous one,
+ *          only the changed tiles and a 2 pixels halo around them (the
+ *          interpolation neighbourhood) are converted again into the
+ *          persistent RGB output. The caller must pass the same RGB buffer
+ *          on every call, any change of the buffer, geometry, format or
+ *          cfa or orientation causes a full frame conversion.
+ */
+class ISP_EXPORT IncrementalDemosaic {
+
+public:
+    /**
+     * @param[in] demosaic  demosaic used to convert the dirty areas,
+     *                      must outlive this object
+     * @param[in] tileSize  compare tile size in pixels
+     */
+    IncrementalDemosaic(const Demosaic &demosaic, int tileSize = 64);
+    ~IncrementalDemosaic();
+
+    /**
+     * @brief set the change threshold
+     * @details a tile is dirty if any sample differs from the previous
+     *          frame by more than threshold (in sensor code values).
+     *          0 (default) means any change.
+     */
+    void setThreshold(int threshold) { m_threshold = threshold; }
+
+    /**
+     * @brief forget the previous frame, next call converts the full frame
+     */
+    void reset();
+
+    /**
+     * @brief convert bayer image to RGB image, refreshing changed tiles only
+     * @param[in]  bayerImage
+     * @param[in]  cfa
+     * @param[out] rgbImage    persistent output, must be the same buffer
+     *                         on every call
+     * @param[out] dirtyRects  areas of rgbImage which were rewritten, in
+     *                         RGB image coordinates (after the orientation
+     *                         of the demosaic), they may overlap by the halo
+     */
+    int bayer2RGB(const BayerImageData &bayerImage, const CFADescriptor &cfa,
+                  RGBImageData &rgbImage, std::vector<ImageRect> &dirtyRects);
+
+private:
+    IncrementalDemosaic(const IncrementalDemosaic &) = delete;
+    IncrementalDemosaic &operator=(const IncrementalDemosaic &) = delete;
+
+    const Demosaic &m_demosaic;
+    int m_tileSize;
+    int m_threshold;
+
+    /* previous frame, rows packed with stride width * bytesPerSample */
+    uint8_t *m_prevFrame;
+    size_t m_prevFrameSize;
+
+    /* stream state of the previous call */
+    bool m_valid;
+    BayerImageData m_prevBayer;
+    CFADescriptor m_prevCfa;
+    ImageOrientation_e m_prevOrientation;
+    Demosaic::LumaMode m_prevLumaMode;
+    const RawDenoise *m_prevDenoise;
+    float m_prevDenoiseSigma;
+    RGBImageData m_prevRGB;
+
+    bool isSameStream(const BayerImageData &bayerImage, const CFADescriptor &cfa,
+                      const RGBImageData &rgbImage) const;
+    bool tileChanged(const BayerImageData &bayerImage, const ImageRect &tile) const;
+    void storeTile(const BayerImageData &bayerImage, const ImageRect &tile);
+};
+
+END_NAMESPACE_ISP
+
+#endif // INCREMENTALDEMOSAIC_H
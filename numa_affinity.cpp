@@ -0,0 +1,267 @@
+/**
+ * @file numa_affinity.cpp
+ *
+ * @brief NUMA helpers implement, raw syscalls so no libnuma is needed
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <thread>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "numa_affinity.h"
+
+ISP_USE_NAMESPACE
+
+/* mbind() mode, from linux/mempolicy.h */
+#define ISP_MPOL_PREFERRED 1
+
+/* nodes of the mbind() mask */
+#define ISP_MAX_NUMA_NODES 1024
+
+/* pages of one numaCountPages() query, kept on the stack */
+#define ISP_MAX_COUNT_PAGES 64
+
+struct NumaTopology {
+    std::vector<int> nodes;
+    std::map<int, std::vector<int> > nodeCpus;
+    std::map<int, int> cpuNode;
+};
+
+/* parse a sysfs cpu list, e.g. "0-3,8-11" */
+static std::vector<int> _parse_cpulist(const char *list)
+{
+    std::vector<int> cpus;
+    const char *p = list;
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p)
+            break;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus.push_back(static_cast<int>(cpu));
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return cpus;
+}
+
+static NumaTopology _read_topology()
+{
+    NumaTopology topology;
+
+#ifdef __linux__
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+
+    while (dir && (entry = readdir(dir)) != nullptr) {
+        int node;
+        char path[256];
+        char list[4096];
+
+        if (sscanf(entry->d_name, "node%d", &node) != 1)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen(path, "r");
+        if (fp == nullptr)
+            continue;
+        if (fgets(list, sizeof(list), fp)) {
+            std::vector<int> cpus = _parse_cpulist(list);
+
+            /* memory only nodes run no workers */
+            if (!cpus.empty())
+                topology.nodeCpus[node] = cpus;
+        }
+        fclose(fp);
+    }
+    if (dir)
+        closedir(dir);
+#endif
+
+    if (topology.nodeCpus.empty()) {
+        std::vector<int> &cpus = topology.nodeCpus[0];
+        int count = static_cast<int>(std::thread::hardware_concurrency());
+
+        for (int cpu = 0; cpu < (count > 0 ? count : 1); cpu++)
+            cpus.push_back(cpu);
+    }
+
+    for (auto &node : topology.nodeCpus) {
+        topology.nodes.push_back(node.first);
+        for (int cpu : node.second)
+            topology.cpuNode[cpu] = node.first;
+    }
+
+    return topology;
+}
+
+static const NumaTopology &_topology()
+{
+    static const NumaTopology topology = _read_topology();
+
+    return topology;
+}
+
+const std::vector<int> &ImageSignalProcessor::numaNodes()
+{
+    return _topology().nodes;
+}
+
+const std::vector<int> &ImageSignalProcessor::numaNodeCpus(int node)
+{
+    static const std::vector<int> none;
+    const NumaTopology &topology = _topology();
+    auto it = topology.nodeCpus.find(node);
+
+    return it != topology.nodeCpus.end() ? it->second : none;
+}
+
+int ImageSignalProcessor::numaCurrentNode()
+{
+#ifdef __linux__
+    const NumaTopology &topology = _topology();
+    auto it = topology.cpuNode.find(sched_getcpu());
+
+    if (it != topology.cpuNode.end())
+        return it->second;
+#endif
+
+    return 0;
+}
+
+int ImageSignalProcessor::numaBindThread(int node)
+{
+    const std::vector<int> &cpus = numaNodeCpus(node);
+
+    if (cpus.empty()) {
+        std::cout << "Invalid numa node " << node << std::endl;
+        return -1;
+    }
+
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        std::cout << "Fail to pin thread to numa node " << node << std::endl;
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+void *ImageSignalProcessor::numaAlloc(size_t size, int node)
+{
+    if (size == 0)
+        return nullptr;
+
+#ifdef __linux__
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED)
+        return nullptr;
+
+    /* a failed mbind() (no NUMA kernel, seccomp) leaves the first touch */
+    if (node >= 0 && node < ISP_MAX_NUMA_NODES) {
+        const int bits = 8 * sizeof(unsigned long);
+        unsigned long mask[ISP_MAX_NUMA_NODES / bits] = {0};
+
+        mask[node / bits] |= 1UL << (node % bits);
+        syscall(SYS_mbind, addr, size, ISP_MPOL_PREFERRED, mask, ISP_MAX_NUMA_NODES + 1, 0);
+    }
+
+    /* first touch, the kernel places the pages now */
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uint8_t *p = reinterpret_cast<uint8_t *>(addr);
+    for (size_t offset = 0; offset < size; offset += pageSize)
+        p[offset] = 0;
+
+    return addr;
+#else
+    (void)node;
+
+    return calloc(1, size);
+#endif
+}
+
+void ImageSignalProcessor::numaFree(void *addr, size_t size)
+{
+    if (addr == nullptr)
+        return;
+
+#ifdef __linux__
+    munmap(addr, size);
+#else
+    (void)size;
+    free(addr);
+#endif
+}
+
+int ImageSignalProcessor::numaCountPages(const void *addr, size_t size, int maxPages, int node,
+                                         uint64_t &localPages, uint64_t &remotePages)
+{
+#ifdef __linux__
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t first = reinterpret_cast<uintptr_t>(addr) & ~(pageSize - 1);
+    size_t pageCount = (reinterpret_cast<uintptr_t>(addr) + size - first + pageSize - 1) / pageSize;
+
+    if (size == 0 || maxPages <= 0)
+        return 0;
+
+    if (maxPages > ISP_MAX_COUNT_PAGES)
+        maxPages = ISP_MAX_COUNT_PAGES;
+
+    int count = static_cast<int>(pageCount < static_cast<size_t>(maxPages) ? pageCount : maxPages);
+    void *pages[ISP_MAX_COUNT_PAGES];
+    int status[ISP_MAX_COUNT_PAGES];
+
+    for (int i = 0; i < count; i++)
+        pages[i] = reinterpret_cast<void *>(first + (pageCount * i / count) * pageSize);
+
+    /* no nodes array: only query where the pages are */
+    if (syscall(SYS_move_pages, 0, count, pages, nullptr, status, 0))
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (status[i] < 0)
+            continue;
+        if (status[i] == node)
+            localPages++;
+        else
+            remotePages++;
+    }
+
+    return 0;
+#else
+    (void)addr;
+    (void)size;
+    (void)maxPages;
+    (void)node;
+    (void)localPages;
+    (void)remotePages;
+
+    return -1;
+#endif
+}
@@ -0,0 +1,70 @@
+/**
+ * @file numa_affinity.h
+ *
+ * @brief NUMA topology, thread pinning and node local memory
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef NUMAAFFINITY_H
+#define NUMAAFFINITY_H
+
+#include <cstdint>
+#include <vector>
+
+#include "imagesignalprocessor.h"
+
+BEGIN_NAMESPACE_ISP
+
+/*
+ * the topology is read once from /sys/devices/system/node, a kernel
+ * without NUMA (or another OS) is seen as a single node 0 holding all
+ * the cpus, so the callers need no special case
+ */
+
+/**
+ * @brief nodes which have cpus, in increasing order
+ */
+ISP_EXPORT const std::vector<int> &numaNodes();
+
+/**
+ * @brief cpus of a node, empty for an unknown node
+ */
+ISP_EXPORT const std::vector<int> &numaNodeCpus(int node);
+
+/**
+ * @brief node of the cpu running the calling thread, 0 if unknown
+ */
+ISP_EXPORT int numaCurrentNode();
+
+/**
+ * @brief pin the calling thread to the cpus of node
+ * @return 0 on success, -1 if the node is unknown or pinning failed
+ */
+ISP_EXPORT int numaBindThread(int node);
+
+/**
+ * @brief allocate page aligned memory on node
+ * @details the pages prefer node through mbind() and are touched before
+ *          returning; when mbind() is not available the first touch by
+ *          the calling thread places them, so pin it first
+ * @param[in] size
+ * @param[in] node  -1 for no placement
+ * @return nullptr on error, release with numaFree()
+ */
+ISP_EXPORT void *numaAlloc(size_t size, int node);
+
+ISP_EXPORT void numaFree(void *addr, size_t size);
+
+/**
+ * @brief count the pages of a buffer on node and on the other nodes
+ * @details samples at most maxPages (up to 64) evenly spread pages with
+ *          one move_pages() call and no allocation, pages not yet
+ *          faulted in are not counted
+ * @return 0 on success, -1 if the pages can not be queried
+ */
+ISP_EXPORT int numaCountPages(const void *addr, size_t size, int maxPages, int node,
+                              uint64_t &localPages, uint64_t &remotePages);
+
+END_NAMESPACE_ISP
+
+#endif // NUMAAFFINITY_H
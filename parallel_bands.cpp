@@ -0,0 +1,63 @@
+/**
+ * @file parallel_bands.cpp
+ *
+ * @brief row band parallel runner implement
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "parallel_bands.h"
+
+ISP_USE_NAMESPACE
+
+int ImageSignalProcessor::defaultThreadCount()
+{
+    int count = static_cast<int>(std::thread::hardware_concurrency());
+
+    return count > 0 ? count : 1;
+}
+
+int ImageSignalProcessor::parallelForBands(int height, int bandHeight, int threadCount,
+                                           const std::function<int(int, int)> &fn)
+{
+    if (bandHeight < 2)
+        bandHeight = 2;
+    bandHeight = (bandHeight + 1) & ~1;
+
+    int bandCount = (height + bandHeight - 1) / bandHeight;
+
+    if (threadCount <= 0)
+        threadCount = defaultThreadCount();
+    if (threadCount > bandCount)
+        threadCount = bandCount;
+
+    std::atomic<int> nextBand(0);
+    std::atomic<int> result(0);
+
+    auto worker = [&]() {
+        int band;
+
+        while ((band = nextBand++) < bandCount) {
+            int y = band * bandHeight;
+            int rows = height - y < bandHeight ? height - y : bandHeight;
+            int rc = fn(y, rows);
+
+            if (rc) {
+                int expected = 0;
+                result.compare_exchange_strong(expected, rc);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; i++)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (std::thread &thread : threads)
+        thread.join();
+
+    return result;
+}
@@ -0,0 +1,38 @@
+/**
+ * @file parallel_bands.h
+ *
+ * @brief run an image stage over row bands on several threads
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef PARALLELBANDS_H
+#define PARALLELBANDS_H
+
+#include <functional>
+
+#include "imagesignalprocessor.h"
+
+BEGIN_NAMESPACE_ISP
+
+/**
+ * @brief call fn(firstRow, rowCount) for every band of bandHeight rows
+ * @details the bands are handed out dynamically to threadCount threads,
+ *          the calling thread is one of them. fn must be thread safe.
+ * @param[in] height       rows of the image
+ * @param[in] bandHeight   rows of a band, rounded up to even to keep the
+ *                         CFA phase of every band
+ * @param[in] threadCount  0 means one per cpu
+ * @param[in] fn
+ * @return the first non-zero result of fn, or 0
+ */
+ISP_EXPORT int parallelForBands(int height, int bandHeight, int threadCount,
+                                const std::function<int(int, int)> &fn);
+
+/**
+ * @brief number of threads used for threadCount 0
+ */
+ISP_EXPORT int defaultThreadCount();
+
+END_NAMESPACE_ISP
+
+#endif // PARALLELBANDS_H
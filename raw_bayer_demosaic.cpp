@@ -6,8 +6,16 @@
  * @author Dan.Cao <caodan@linuxtoy.cn>
  */
 #include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "raw_bayer_demosaic.h"
+#include "raw_denoise.h"
 
 ISP_USE_NAMESPACE
 
@@ -23,8 +31,35 @@ ISP_USE_NAMESPACE
 #define CLAMP(_v, _min, _max)  MIN(MAX(_v, _min), _max)
 #endif
 
+/*
+ * the kernels are many template instances, which exhausts the inline
+ * budget of the compiler: force the per sample and per pixel helpers
+ */
+#if defined(__GNUC__)
+#define ISP_FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define ISP_FORCE_INLINE inline
+#endif
+
+/* block size of the rotated output, in pixels */
+#define ROTATE_BLOCK_SIZE 64
+
+/*
+ * farthest row or column read by the kernels: the border clamp is only
+ * needed this close to the image edge, and it is the minimum fused
+ * denoise halo
+ */
+#define KERNEL_RADIUS 2
+
+/* last level cache size if it can not be read from the system */
+#define DEFAULT_LLC_SIZE (8 * 1024 * 1024)
+
 Demosaic::Demosaic(enum DemosaicInterPolation method)
     : m_interpolationMethod (method)
+    , m_orientation (ORIENTATION_NORMAL)
+    , m_streamingStore (STREAMING_STORE_AUTO)
+    , m_lumaMode (LUMA_WEIGHTED)
+    , m_rawDenoise (nullptr)
     , m_gammaLUT(nullptr)
 {
     float kFactor = 0.33;
@@ -46,17 +81,67 @@ Demosaic::Demosaic()
 }
 
 int Demosaic::bayer2RGB(const BayerImageData &bayerImage,
-                         BayerCFAPattern_e cfa, RGBImageData &rgbImage) const
+                         const CFADescriptor &cfa, RGBImageData &rgbImage) const
+{
+    ImageRect rect(0, 0, bayerImage.width, bayerImage.height);
+
+    return bayer2RGBRegion(bayerImage, cfa, rect, rgbImage);
+}
+
+ImageRect Demosaic::outputRect(const ImageRect &rect, int width, int height) const
+{
+    switch (m_orientation) {
+    case ORIENTATION_ROTATE_90:
+        return ImageRect(height - rect.y - rect.height, rect.x, rect.height, rect.width);
+    case ORIENTATION_ROTATE_180:
+        return ImageRect(width - rect.x - rect.width, height - rect.y - rect.height,
+                         rect.width, rect.height);
+    case ORIENTATION_ROTATE_270:
+        return ImageRect(rect.y, width - rect.x - rect.width, rect.height, rect.width);
+    case ORIENTATION_MIRROR_H:
+        return ImageRect(width - rect.x - rect.width, rect.y, rect.width, rect.height);
+    case ORIENTATION_MIRROR_V:
+        return ImageRect(rect.x, height - rect.y - rect.height, rect.width, rect.height);
+    case ORIENTATION_NORMAL:
+    default:
+        return rect;
+    }
+}
+
+bool Demosaic::checkRegion(int width, int height, const ImageRect &rect,
+                           const RGBImageData &rgbImage) const
+{
+    if (rect.x < 0 || rect.y < 0 || rect.width < 0 || rect.height < 0
+        || rect.x + rect.width > width
+        || rect.y + rect.height > height) {
+        std::cout << "Invalid region " << rect.x << "," << rect.y << " "
+            << rect.width << "x" << rect.height << std::endl;
+        return false;
+    }
+
+    bool transposed = m_orientation == ORIENTATION_ROTATE_90
+        || m_orientation == ORIENTATION_ROTATE_270;
+    int outWidth = transposed ? height : width;
+    int outHeight = transposed ? width : height;
+
+    if (rgbImage.width < outWidth || rgbImage.height < outHeight) {
+        std::cout << "RGB image " << rgbImage.width << "x" << rgbImage.height
+            << " too small, need " << outWidth << "x" << outHeight << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int Demosaic::bayer2RGBRegion(const BayerImageData &bayerImage,
+                              const CFADescriptor &cfa, const ImageRect &rect,
+                              RGBImageData &rgbImage) const
 {
+    if (!checkRegion(bayerImage.width, bayerImage.height, rect, rgbImage))
+        return -1;
+
     if (m_interpolationMethod == BILINEAR_INTERPOLATION) {
-        if (rgbImage.format == FORMAT_RGB888)
-            bayer2RGB888_BilinearInterpolation(bayerImage, cfa, rgbImage);
-        else if (rgbImage.format == FORMAT_RGB32)
-            bayer2RGB32_BilinearInterpolation(bayerImage, cfa, rgbImage);
-        else {
-            std::cout << "Unsupport rgb format " << rgbImage.format << std::endl;
-            return -1;
-        }
+        return bayer2RGB_BilinearInterpolation(bayerImage, cfa, rect, rgbImage);
     } else {
         std::cout << "Unsupport alg " << m_interpolationMethod << std::endl;
         return -1;
@@ -65,23 +150,31 @@ int Demosaic::bayer2RGB(const BayerImageData &bayerImage,
     return 0;
 }
 
-static inline uint16_t bayerAt(const BayerImageData &bayerImage,
-		int col, int row)
+/*
+ * Edge is false in the interior, where the 5x5 neighbourhood is inside
+ * the image and the border clamp is skipped
+ */
+template <bool Edge = true>
+static ISP_FORCE_INLINE uint16_t bayerAt(const BayerImageData &bayerImage,
+		int col, int row, int period = 2)
 {
     uint16_t value;
 
     /* clamp the border
      * col may out of the image area 1 or 2 cols
      * row may out of the image area 1 or 2 row
+     * move by a CFA period to keep the same color
      */
-    if (row < 0)
-        row += 2;
-    else if (row >= bayerImage.height)
-        row -= 2;
-    if (col < 0)
-        col += 2;
-    else if (col >= bayerImage.width)
-        col -= 2;
+    if (Edge) {
+        if (row < 0)
+            row += period;
+        else if (row >= bayerImage.height)
+            row -= period;
+        if (col < 0)
+            col += period;
+        else if (col >= bayerImage.width)
+            col -= period;
+    }
 
     if (bayerImage.format == FORMAT_RAW8) {
         uint8_t *data = reinterpret_cast<uint8_t *>((intptr_t)bayerImage.imageData + row * bayerImage.stride);
@@ -104,29 +197,30 @@ static inline uint16_t bayerAt(const BayerImageData &bayerImage,
 }
 
 /* BilinearInterpolation Pixel R */
-static inline void BI_Pixel_R(int row, int col,
+template <bool Edge>
+static ISP_FORCE_INLINE void BI_Pixel_R(int row, int col,
                        const BayerImageData &bayerImage,
                        uint16_t &R, uint16_t &G, uint16_t &B)
 {
         /* Get G */
-        uint16_t G1 = bayerAt(bayerImage, col,     row - 1);
-        uint16_t G2 = bayerAt(bayerImage, col + 1, row    );
-        uint16_t G3 = bayerAt(bayerImage, col,     row + 1);
-        uint16_t G4 = bayerAt(bayerImage, col - 1, row    );
+        uint16_t G1 = bayerAt<Edge>(bayerImage, col,     row - 1);
+        uint16_t G2 = bayerAt<Edge>(bayerImage, col + 1, row    );
+        uint16_t G3 = bayerAt<Edge>(bayerImage, col,     row + 1);
+        uint16_t G4 = bayerAt<Edge>(bayerImage, col - 1, row    );
 
         /* Get R */
-        uint16_t R1 = bayerAt(bayerImage, col,     row - 2);
-        uint16_t R2 = bayerAt(bayerImage, col + 2, row    );
-        uint16_t R3 = bayerAt(bayerImage, col,     row + 2);
-        uint16_t R4 = bayerAt(bayerImage, col - 2, row    );
+        uint16_t R1 = bayerAt<Edge>(bayerImage, col,     row - 2);
+        uint16_t R2 = bayerAt<Edge>(bayerImage, col + 2, row    );
+        uint16_t R3 = bayerAt<Edge>(bayerImage, col,     row + 2);
+        uint16_t R4 = bayerAt<Edge>(bayerImage, col - 2, row    );
 
         /* Get B */
-        uint16_t B1 = bayerAt(bayerImage, col - 1, row - 1);
-        uint16_t B2 = bayerAt(bayerImage, col + 1, row - 1);
-        uint16_t B3 = bayerAt(bayerImage, col + 1, row + 1);
-        uint16_t B4 = bayerAt(bayerImage, col - 1, row + 1);
+        uint16_t B1 = bayerAt<Edge>(bayerImage, col - 1, row - 1);
+        uint16_t B2 = bayerAt<Edge>(bayerImage, col + 1, row - 1);
+        uint16_t B3 = bayerAt<Edge>(bayerImage, col + 1, row + 1);
+        uint16_t B4 = bayerAt<Edge>(bayerImage, col - 1, row + 1);
 
-        R = bayerAt(bayerImage, col, row);
+        R = bayerAt<Edge>(bayerImage, col, row);
 
         if (abs(R1 - R3) < abs(R2 - R4)) {
             G = static_cast<uint32_t>(G1 + G3) / 2;
@@ -140,55 +234,58 @@ static inline void BI_Pixel_R(int row, int col,
 }
 
 /* BilinearInterpolation Pixel Gr */
-static inline void BI_Pixel_Gr(int row, int col,
+template <bool Edge>
+static ISP_FORCE_INLINE void BI_Pixel_Gr(int row, int col,
                        const BayerImageData &bayerImage,
                        uint16_t &R, uint16_t &G, uint16_t &B)
 {
-        uint16_t R1 = bayerAt(bayerImage, col - 1, row);
-        uint16_t R2 = bayerAt(bayerImage, col + 1, row);
+        uint16_t R1 = bayerAt<Edge>(bayerImage, col - 1, row);
+        uint16_t R2 = bayerAt<Edge>(bayerImage, col + 1, row);
 
-        uint16_t B1 = bayerAt(bayerImage, col, row - 1);
-        uint16_t B2 = bayerAt(bayerImage, col, row + 1);
+        uint16_t B1 = bayerAt<Edge>(bayerImage, col, row - 1);
+        uint16_t B2 = bayerAt<Edge>(bayerImage, col, row + 1);
 
         R = static_cast<uint32_t>(R1 + R2) / 2;
-        G = bayerAt(bayerImage, col, row);
+        G = bayerAt<Edge>(bayerImage, col, row);
         B = static_cast<uint32_t>(B1 + B2) / 2;
 }
 
 /* BilinearInterpolation Pixel Gb */
-static inline void BI_Pixel_Gb(int row, int col,
+template <bool Edge>
+static ISP_FORCE_INLINE void BI_Pixel_Gb(int row, int col,
                        const BayerImageData &bayerImage,
                        uint16_t &R, uint16_t &G, uint16_t &B)
 {
-        uint16_t R1 = bayerAt(bayerImage, col, row - 1);
-        uint16_t R2 = bayerAt(bayerImage, col, row + 1);
+        uint16_t R1 = bayerAt<Edge>(bayerImage, col, row - 1);
+        uint16_t R2 = bayerAt<Edge>(bayerImage, col, row + 1);
 
-        uint16_t B1 = bayerAt(bayerImage, col - 1, row);
-        uint16_t B2 = bayerAt(bayerImage, col + 1, row);
+        uint16_t B1 = bayerAt<Edge>(bayerImage, col - 1, row);
+        uint16_t B2 = bayerAt<Edge>(bayerImage, col + 1, row);
 
         R = static_cast<uint32_t>(R1 + R2) / 2;
-        G = bayerAt(bayerImage, col, row);
+        G = bayerAt<Edge>(bayerImage, col, row);
         B = static_cast<uint32_t>(B1 + B2) / 2;
 }
 
-static inline void BI_Pixel_B(int row, int col,
+template <bool Edge>
+static ISP_FORCE_INLINE void BI_Pixel_B(int row, int col,
                        const BayerImageData &bayerImage,
                        uint16_t &R, uint16_t &G, uint16_t &B)
 {
-        uint16_t G1 = bayerAt(bayerImage, col,     row - 1);
-        uint16_t G2 = bayerAt(bayerImage, col + 1, row);
-        uint16_t G3 = bayerAt(bayerImage, col,     row + 1);
-        uint16_t G4 = bayerAt(bayerImage, col - 1, row);
+        uint16_t G1 = bayerAt<Edge>(bayerImage, col,     row - 1);
+        uint16_t G2 = bayerAt<Edge>(bayerImage, col + 1, row);
+        uint16_t G3 = bayerAt<Edge>(bayerImage, col,     row + 1);
+        uint16_t G4 = bayerAt<Edge>(bayerImage, col - 1, row);
 
-        uint16_t B1 = bayerAt(bayerImage, col,     row - 2);
-        uint16_t B2 = bayerAt(bayerImage, col + 2, row);
-        uint16_t B3 = bayerAt(bayerImage, col,     row + 2);
-        uint16_t B4 = bayerAt(bayerImage, col - 2, row);
+        uint16_t B1 = bayerAt<Edge>(bayerImage, col,     row - 2);
+        uint16_t B2 = bayerAt<Edge>(bayerImage, col + 2, row);
+        uint16_t B3 = bayerAt<Edge>(bayerImage, col,     row + 2);
+        uint16_t B4 = bayerAt<Edge>(bayerImage, col - 2, row);
 
-        uint16_t R1 = bayerAt(bayerImage, col - 1, row - 1);
-        uint16_t R2 = bayerAt(bayerImage, col + 1, row - 1);
-        uint16_t R3 = bayerAt(bayerImage, col + 1, row + 1);
-        uint16_t R4 = bayerAt(bayerImage, col - 1, row + 1);
+        uint16_t R1 = bayerAt<Edge>(bayerImage, col - 1, row - 1);
+        uint16_t R2 = bayerAt<Edge>(bayerImage, col + 1, row - 1);
+        uint16_t R3 = bayerAt<Edge>(bayerImage, col + 1, row + 1);
+        uint16_t R4 = bayerAt<Edge>(bayerImage, col - 1, row + 1);
 
         R = (R1 + R2 + R3 + R4) / 4;
 
@@ -200,95 +297,368 @@ static inline void BI_Pixel_B(int row, int col,
             G = (G1 + G2 + G3 + G4) / 4;
         }
 
-        B = bayerAt(bayerImage, col, row);
+        B = bayerAt<Edge>(bayerImage, col, row);
+}
+
+/*
+ * compile time CFA layout, the colors of the period x period tile are
+ * packed 2 bits each, row major, first site in the lowest bits
+ */
+static constexpr uint32_t _cfa_color(char c)
+{
+    return c == 'R' ? CFA_COLOR_R : c == 'G' ? CFA_COLOR_G
+        : c == 'B' ? CFA_COLOR_B : CFA_COLOR_W;
 }
 
-static inline void RGGB2RGB_BI(int row, int col,
-                              const BayerImageData &bayerImage,
-                              uint16_t &R, uint16_t &G, uint16_t &B)
+static constexpr uint32_t _cfa_pack(const char *pattern, int i = 0)
 {
-    if (row % 2 == 0 && col % 2 == 0) {
-        BI_Pixel_R(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 0 && col % 2 == 1) {
-        BI_Pixel_Gr(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 1 && col % 2 == 0) {
-        BI_Pixel_Gb(row, col, bayerImage, R, G, B);
-    } else {
-        BI_Pixel_B(row, col, bayerImage, R, G, B);
+    return pattern[i] == '\0' ? 0
+        : (_cfa_color(pattern[i]) << (2 * i)) | _cfa_pack(pattern, i + 1);
+}
+
+template <int P, uint32_t Layout>
+struct CFALayout {
+    static constexpr int period = P;
+
+    static constexpr CFAColor_e at(int row, int col) {
+        return static_cast<CFAColor_e>((Layout >> (2 * ((row % P) * P + col % P))) & 3);
     }
+};
+
+/* BilinearInterpolation G only at a R or B pixel, same as BI_Pixel_R/B */
+template <bool Edge>
+static ISP_FORCE_INLINE uint16_t BI_Green_RB(int row, int col,
+                                   const BayerImageData &bayerImage)
+{
+        uint16_t G1 = bayerAt<Edge>(bayerImage, col,     row - 1);
+        uint16_t G2 = bayerAt<Edge>(bayerImage, col + 1, row    );
+        uint16_t G3 = bayerAt<Edge>(bayerImage, col,     row + 1);
+        uint16_t G4 = bayerAt<Edge>(bayerImage, col - 1, row    );
+
+        uint16_t C1 = bayerAt<Edge>(bayerImage, col,     row - 2);
+        uint16_t C2 = bayerAt<Edge>(bayerImage, col + 2, row    );
+        uint16_t C3 = bayerAt<Edge>(bayerImage, col,     row + 2);
+        uint16_t C4 = bayerAt<Edge>(bayerImage, col - 2, row    );
+
+        if (abs(C1 - C3) < abs(C2 - C4))
+            return static_cast<uint32_t>(G1 + G3) / 2;
+        else if (abs(C1 - C3) > abs(C2 - C4))
+            return static_cast<uint32_t>(G2 + G4) / 2;
+        else
+            return static_cast<uint32_t>(G1 + G2 + G3 + G4) / 4;
 }
 
-static inline void GRBG2RGB_BI(int row, int col,
-                              const BayerImageData &bayerImage,
-                              uint16_t &R, uint16_t &G, uint16_t &B)
+/*
+ * 2x2 bayer, edge directed bilinear interpolation at the tile position
+ * (Y, X), the color tests are folded at compile time
+ * GreenOnly interpolates G only, R and B are left unset
+ */
+template <class L, int Y, int X, bool GreenOnly, bool Edge>
+static ISP_FORCE_INLINE void Bayer2RGB_BI_Site(int row, int col,
+                                               const BayerImageData &bayerImage,
+                                               uint16_t &R, uint16_t &G, uint16_t &B)
 {
-    if (row % 2 == 0 && col % 2 == 0) {
-        BI_Pixel_Gr(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 0 && col % 2 == 1) {
-        BI_Pixel_R(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 1 && col % 2 == 0) {
-        BI_Pixel_B(row, col, bayerImage, R, G, B);
-    } else {
-        BI_Pixel_Gb(row, col, bayerImage, R, G, B);
+    static_assert(L::period == 2, "bayer kernel needs a 2x2 layout");
+
+    if (GreenOnly) {
+        if (L::at(Y, X) == CFA_COLOR_G)
+            G = bayerAt<Edge>(bayerImage, col, row);
+        else
+            G = BI_Green_RB<Edge>(row, col, bayerImage);
+    } else if (L::at(Y, X) == CFA_COLOR_R)
+        BI_Pixel_R<Edge>(row, col, bayerImage, R, G, B);
+    else if (L::at(Y, X) == CFA_COLOR_B)
+        BI_Pixel_B<Edge>(row, col, bayerImage, R, G, B);
+    else if (L::at(Y, X ^ 1) == CFA_COLOR_R)
+        BI_Pixel_Gr<Edge>(row, col, bayerImage, R, G, B);
+    else
+        BI_Pixel_Gb<Edge>(row, col, bayerImage, R, G, B);
+}
+
+/* any position, for the border pixels */
+template <class L, bool GreenOnly, bool Edge>
+static inline void Bayer2RGB_BI(int row, int col,
+                                const BayerImageData &bayerImage,
+                                uint16_t &R, uint16_t &G, uint16_t &B)
+{
+    switch ((row & 1) * 2 + (col & 1)) {
+    case 0:
+        Bayer2RGB_BI_Site<L, 0, 0, GreenOnly, Edge>(row, col, bayerImage, R, G, B);
+        break;
+    case 1:
+        Bayer2RGB_BI_Site<L, 0, 1, GreenOnly, Edge>(row, col, bayerImage, R, G, B);
+        break;
+    case 2:
+        Bayer2RGB_BI_Site<L, 1, 0, GreenOnly, Edge>(row, col, bayerImage, R, G, B);
+        break;
+    default:
+        Bayer2RGB_BI_Site<L, 1, 1, GreenOnly, Edge>(row, col, bayerImage, R, G, B);
+        break;
     }
 }
 
-static inline void GBRG2RGB_BI(int row, int col,
-                              const BayerImageData &bayerImage,
-                              uint16_t &R, uint16_t &G, uint16_t &B)
+/*
+ * neighbour interpolation of one color at the tile position (PR, PC):
+ * the site itself if it has the color, else the mean of the same color
+ * sites of the 3x3 neighbourhood, else of the 5x5 ring.
+ * The position is known at compile time, so the loops are unrolled and
+ * the color tests are folded away.
+ */
+template <class L, int PR, int PC, CFAColor_e C, bool Edge>
+static inline uint16_t NI_Channel(int row, int col, const BayerImageData &bayerImage)
 {
-    if (row % 2 == 0 && col % 2 == 0) {
-        BI_Pixel_Gb(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 0 && col % 2 == 1) {
-        BI_Pixel_B(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 1 && col % 2 == 0) {
-        BI_Pixel_R(row, col, bayerImage, R, G, B);
-    } else {
-        BI_Pixel_Gr(row, col, bayerImage, R, G, B);
+    const int P = L::period;
+    uint32_t sum = 0;
+    int count = 0;
+
+    if (L::at(PR, PC) == C)
+        return bayerAt<Edge>(bayerImage, col, row, P);
+
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            if (L::at(PR + dy + P, PC + dx + P) == C) {
+                sum += bayerAt<Edge>(bayerImage, col + dx, row + dy, P);
+                count++;
+            }
+        }
     }
+    if (count)
+        return sum / count;
+
+    for (int dy = -2; dy <= 2; dy++) {
+        for (int dx = -2; dx <= 2; dx++) {
+            if ((dy == -2 || dy == 2 || dx == -2 || dx == 2)
+                && L::at(PR + dy + P, PC + dx + P) == C) {
+                sum += bayerAt<Edge>(bayerImage, col + dx, row + dy, P);
+                count++;
+            }
+        }
+    }
+
+    return count ? sum / count : 0;
 }
 
-static inline void BGGR2RGB_BI(int row, int col,
-                              const BayerImageData &bayerImage,
-                              uint16_t &R, uint16_t &G, uint16_t &B)
+template <class L, int PR, int PC, bool GreenOnly, bool Edge>
+static inline void NI_Pixel(int row, int col, const BayerImageData &bayerImage,
+                            uint16_t &R, uint16_t &G, uint16_t &B)
 {
-    if (row % 2 == 0 && col % 2 == 0) {
-        BI_Pixel_B(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 0 && col % 2 == 1) {
-        BI_Pixel_Gb(row, col, bayerImage, R, G, B);
-    } else if (row % 2 == 1 && col % 2 == 0) {
-        BI_Pixel_Gr(row, col, bayerImage, R, G, B);
+    G = NI_Channel<L, PR, PC, CFA_COLOR_G, Edge>(row, col, bayerImage);
+    if (!GreenOnly) {
+        R = NI_Channel<L, PR, PC, CFA_COLOR_R, Edge>(row, col, bayerImage);
+        B = NI_Channel<L, PR, PC, CFA_COLOR_B, Edge>(row, col, bayerImage);
+    }
+}
+
+/* 4x4 layouts (quad bayer, RGBW), neighbour interpolation */
+template <class L, bool GreenOnly, bool Edge>
+static inline void CFA4x42RGB_NI(int row, int col,
+                                 const BayerImageData &bayerImage,
+                                 uint16_t &R, uint16_t &G, uint16_t &B)
+{
+    static_assert(L::period == 4, "4x4 kernel needs a 4x4 layout");
+
+#define NI_PHASE(pr, pc) \
+    case (pr) * 4 + (pc): \
+        NI_Pixel<L, pr, pc, GreenOnly, Edge>(row, col, bayerImage, R, G, B); \
+        break;
+
+    switch ((row & 3) * 4 + (col & 3)) {
+    NI_PHASE(0, 0) NI_PHASE(0, 1) NI_PHASE(0, 2) NI_PHASE(0, 3)
+    NI_PHASE(1, 0) NI_PHASE(1, 1) NI_PHASE(1, 2) NI_PHASE(1, 3)
+    NI_PHASE(2, 0) NI_PHASE(2, 1) NI_PHASE(2, 2) NI_PHASE(2, 3)
+    NI_PHASE(3, 0) NI_PHASE(3, 1) NI_PHASE(3, 2) NI_PHASE(3, 3)
+    }
+
+#undef NI_PHASE
+}
+
+#define CFA_LAYOUT_RGGB         _cfa_pack("RGGB")
+#define CFA_LAYOUT_BGGR         _cfa_pack("BGGR")
+#define CFA_LAYOUT_GRBG         _cfa_pack("GRBG")
+#define CFA_LAYOUT_GBRG         _cfa_pack("GBRG")
+#define CFA_LAYOUT_QUAD_RGGB    _cfa_pack("RRGGRRGGGGBBGGBB")
+#define CFA_LAYOUT_QUAD_BGGR    _cfa_pack("BBGGBBGGGGRRGGRR")
+#define CFA_LAYOUT_QUAD_GRBG    _cfa_pack("GGRRGGRRBBGGBBGG")
+#define CFA_LAYOUT_QUAD_GBRG    _cfa_pack("GGBBGGBBRRGGRRGG")
+#define CFA_LAYOUT_RGBW         _cfa_pack("WRWGRWGWWGWBGWBW")
+
+/* kernels instantiated for the common layouts */
+enum CFAKernel_e {
+    KERNEL_BAYER_RGGB = 0,
+    KERNEL_BAYER_BGGR,
+    KERNEL_BAYER_GRBG,
+    KERNEL_BAYER_GBRG,
+    KERNEL_QUAD_RGGB,
+    KERNEL_QUAD_BGGR,
+    KERNEL_QUAD_GRBG,
+    KERNEL_QUAD_GBRG,
+    KERNEL_RGBW,
+    KERNEL_GENERIC,
+};
+
+static CFAKernel_e _select_kernel(const CFADescriptor &cfa)
+{
+    uint32_t layout = 0;
+
+    if (cfa.period != 2 && cfa.period != 4)
+        return KERNEL_GENERIC;
+
+    for (int i = 0; i < cfa.period * cfa.period; i++)
+        layout |= static_cast<uint32_t>(cfa.colors[i]) << (2 * i);
+
+    if (cfa.period == 2) {
+        switch (layout) {
+        case CFA_LAYOUT_RGGB:
+            return KERNEL_BAYER_RGGB;
+        case CFA_LAYOUT_BGGR:
+            return KERNEL_BAYER_BGGR;
+        case CFA_LAYOUT_GRBG:
+            return KERNEL_BAYER_GRBG;
+        case CFA_LAYOUT_GBRG:
+            return KERNEL_BAYER_GBRG;
+        }
     } else {
-        BI_Pixel_R(row, col, bayerImage, R, G, B);
+        switch (layout) {
+        case CFA_LAYOUT_QUAD_RGGB:
+            return KERNEL_QUAD_RGGB;
+        case CFA_LAYOUT_QUAD_BGGR:
+            return KERNEL_QUAD_BGGR;
+        case CFA_LAYOUT_QUAD_GRBG:
+            return KERNEL_QUAD_GRBG;
+        case CFA_LAYOUT_QUAD_GBRG:
+            return KERNEL_QUAD_GBRG;
+        case CFA_LAYOUT_RGBW:
+            return KERNEL_RGBW;
+        }
+    }
+
+    return KERNEL_GENERIC;
+}
+
+/*
+ * same color neighbours of every tile position for the generic kernel,
+ * built at run time with the same rule as NI_Channel
+ */
+#define CFA_MAX_NEIGHBOURS 16
+
+struct CFANeighbourTable {
+    int period;
+    int count[CFA_MAX_PERIOD * CFA_MAX_PERIOD][3];
+    int8_t dx[CFA_MAX_PERIOD * CFA_MAX_PERIOD][3][CFA_MAX_NEIGHBOURS];
+    int8_t dy[CFA_MAX_PERIOD * CFA_MAX_PERIOD][3][CFA_MAX_NEIGHBOURS];
+};
+
+static void _build_neighbour_table(const CFADescriptor &cfa, CFANeighbourTable &table)
+{
+    const int P = cfa.period;
+
+    table.period = P;
+    for (int pr = 0; pr < P; pr++) {
+        for (int pc = 0; pc < P; pc++) {
+            int phase = pr * P + pc;
+
+            for (int c = CFA_COLOR_R; c <= CFA_COLOR_B; c++) {
+                int &count = table.count[phase][c];
+
+                count = 0;
+                if (cfa.colorAt(pr, pc) == c) {
+                    table.dx[phase][c][0] = 0;
+                    table.dy[phase][c][0] = 0;
+                    count = 1;
+                    continue;
+                }
+
+                for (int radius = 1; radius <= 2 && count == 0; radius++) {
+                    for (int dy = -radius; dy <= radius; dy++) {
+                        for (int dx = -radius; dx <= radius; dx++) {
+                            if ((dy == -radius || dy == radius || dx == -radius || dx == radius)
+                                && cfa.colorAt(pr + dy + P, pc + dx + P) == c
+                                && count < CFA_MAX_NEIGHBOURS) {
+                                table.dx[phase][c][count] = dx;
+                                table.dy[phase][c][count] = dy;
+                                count++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
     }
 }
 
 static int _get_output_shift(RawFormat_e format)
 {
-    int shift;
+    int bits = rawFormatBits(format);
 
-    switch (format) {
-    case FORMAT_RAW8:
-        shift = 0;
+    if (bits < 0) {
+        std::cout << "Invalid bayer mem format " << format << std::endl;
+        return -1;
+    }
+
+    /* to 8 bits */
+    return bits - 8;
+}
+
+/* CFA kernel, one of the *2RGB_* above */
+typedef void (*CFA2RGBFunc)(int row, int col, const BayerImageData &bayerImage,
+                            uint16_t &R, uint16_t &G, uint16_t &B);
+
+/*
+ * destination of the bayer pixel (row, col) is
+ *     origin + row * rowStep + col * colStep
+ * which covers all the orientations, the 180 degrees and the mirrors
+ * just walk the rows and/or the columns backwards, the 90 and 270
+ * degrees walk a column of the RGB image for each bayer row.
+ */
+struct OutputMapping {
+    uint8_t *origin;
+    ptrdiff_t rowStep;
+    ptrdiff_t colStep;
+};
+
+static OutputMapping _get_output_mapping(ImageOrientation_e orientation,
+                                         int width, int height, int bpp,
+                                         RGBImageData &rgbImage)
+{
+    uint8_t *base = reinterpret_cast<uint8_t *>(rgbImage.imageData);
+    ptrdiff_t stride = rgbImage.stride;
+    OutputMapping m;
+
+    switch (orientation) {
+    case ORIENTATION_ROTATE_90:
+        m.origin = base + (height - 1) * bpp;
+        m.rowStep = -bpp;
+        m.colStep = stride;
         break;
-    case FORMAT_RAW10_UNPACKED:
-        shift = 2;
+    case ORIENTATION_ROTATE_180:
+        m.origin = base + (height - 1) * stride + (width - 1) * bpp;
+        m.rowStep = -stride;
+        m.colStep = -bpp;
         break;
-    case FORMAT_RAW12_UNPACKED:
-        shift = 4;
+    case ORIENTATION_ROTATE_270:
+        m.origin = base + (width - 1) * stride;
+        m.rowStep = bpp;
+        m.colStep = -stride;
         break;
-    case FORMAT_RAW14_UNPACKED:
-        shift = 6;
+    case ORIENTATION_MIRROR_H:
+        m.origin = base + (width - 1) * bpp;
+        m.rowStep = stride;
+        m.colStep = -bpp;
         break;
-    case FORMAT_RAW16:
-        shift = 8;
+    case ORIENTATION_MIRROR_V:
+        m.origin = base + (height - 1) * stride;
+        m.rowStep = -stride;
+        m.colStep = bpp;
         break;
+    case ORIENTATION_NORMAL:
     default:
-        std::cout << "Invalid bayer mem format " << format << std::endl;
-        return -1;
+        m.origin = base;
+        m.rowStep = stride;
+        m.colStep = bpp;
+        break;
     }
 
-    return shift;
+    return m;
 }
 
 /*
@@ -296,149 +666,728 @@ static int _get_output_shift(RawFormat_e format)
  * 2nd bytes: G
  * 3rd bytes: B
  */
-int Demosaic::bayer2RGB888_BilinearInterpolation(const BayerImageData &bayerImage,
-                              BayerCFAPattern_e cfa,
-                              RGBImageData &rgbImage) const
+static inline void _store_RGB888(uint8_t *dst, uint16_t R, uint16_t G, uint16_t B, int shift)
 {
-    int shift = _get_output_shift(bayerImage.format);
+    dst[0] = CLAMP((R >> shift), 0, 255);
+    dst[1] = CLAMP((G >> shift), 0, 255);
+    dst[2] = CLAMP((B >> shift), 0, 255);
+}
 
-    if (shift < 0)
-        return -1;
+/*
+ * 32bit RGB format  32-bit RGB format (0xffRRGGBB)
+ * also used for ARGB32 (0xAARRGGBB), the output is opaque
+ */
+static inline void _store_RGB32(uint8_t *dst, uint16_t R, uint16_t G, uint16_t B, int shift)
+{
+    R = CLAMP((R >> shift), 0, 255);
+    G = CLAMP((G >> shift), 0, 255);
+    B = CLAMP((B >> shift), 0, 255);
+    *reinterpret_cast<uint32_t *>(dst) = (0xff000000 | (R << 16) | (G << 8) | B);
+}
 
-    if (cfa == BAYER_CFA_RGGB) {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint8_t *rgbLineBuf = reinterpret_cast<uint8_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+/*
+ * byte ordered RGBA8888, 0xRR 0xGG 0xBB 0xAA on any architecture
+ */
+static inline void _store_RGBA8888(uint8_t *dst, uint16_t R, uint16_t G, uint16_t B, int shift)
+{
+    dst[0] = CLAMP((R >> shift), 0, 255);
+    dst[1] = CLAMP((G >> shift), 0, 255);
+    dst[2] = CLAMP((B >> shift), 0, 255);
+    dst[3] = 0xff;
+}
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+/*
+ * luma of the BT.601 weights, 8 bit fixed point: 0.299 R + 0.587 G + 0.114 B
+ */
+static inline uint32_t _luma(uint16_t R, uint16_t G, uint16_t B)
+{
+    return (77 * R + 150 * G + 29 * B + 128) >> 8;
+}
 
-                RGGB2RGB_BI(row, col, bayerImage, R, G, B);
+/*
+ * 8 bit gray, the luma or the interpolated G only
+ */
+static inline void _store_Y8(uint8_t *dst, uint16_t R, uint16_t G, uint16_t B, int shift)
+{
+    dst[0] = CLAMP((_luma(R, G, B) >> shift), 0, 255);
+}
 
-                rgbLineBuf[col * 3]     = CLAMP((R >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 1] = CLAMP((G >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 2] = CLAMP((B >> shift), 0, 255);
-            }
-        }
-    } else if (cfa == BAYER_CFA_BGGR) {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint8_t *rgbLineBuf = reinterpret_cast<uint8_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+static inline void _store_G8(uint8_t *dst, uint16_t R, uint16_t G, uint16_t B, int shift)
+{
+    dst[0] = CLAMP((G >> shift), 0, 255);
+}
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+/*
+ * 16 bit gray, msb aligned: the sensor bits are shifted to the top
+ */
+static inline void _store_Y16(uint8_t *dst, uint16_t R, uint16_t G, uint16_t B, int shift)
+{
+    uint32_t Y = _luma(R, G, B) << (8 - shift);
 
-                BGGR2RGB_BI(row, col, bayerImage, R, G, B);
+    *reinterpret_cast<uint16_t *>(dst) = MIN(Y, 0xffffu);
+}
 
-                rgbLineBuf[col * 3]     = CLAMP((R >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 1] = CLAMP((G >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 2] = CLAMP((B >> shift), 0, 255);
-            }
-        }
-    } else if (cfa == BAYER_CFA_GRBG) {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint8_t *rgbLineBuf = reinterpret_cast<uint8_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+static inline void _store_G16(uint8_t *dst, uint16_t R, uint16_t G, uint16_t B, int shift)
+{
+    uint32_t Y = static_cast<uint32_t>(G) << (8 - shift);
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+    *reinterpret_cast<uint16_t *>(dst) = MIN(Y, 0xffffu);
+}
 
-                GRBG2RGB_BI(row, col, bayerImage, R, G, B);
+/*
+ * converts the columns [colBegin, colEnd) of a row, the pixel col is
+ * written to dst + (col - colBegin) * colStep, returns the next dst
+ */
+typedef uint8_t *(*CFA2RGBSpanFunc)(const BayerImageData &bayerImage, int row,
+                                    int colBegin, int colEnd, int shift,
+                                    uint8_t *dst, ptrdiff_t colStep);
+
+template <CFA2RGBFunc CFA2RGB,
+          void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int)>
+static inline uint8_t *_bayer2RGB_Span(const BayerImageData &bayerImage, int row,
+                                       int colBegin, int colEnd, int shift,
+                                       uint8_t *dst, ptrdiff_t colStep)
+{
+    for (int col = colBegin; col < colEnd; col++) {
+        uint16_t R, G, B;
 
-                rgbLineBuf[col * 3]     = CLAMP((R >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 1] = CLAMP((G >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 2] = CLAMP((B >> shift), 0, 255);
-            }
-        }
-    } else {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint8_t *rgbLineBuf = reinterpret_cast<uint8_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+        CFA2RGB(row, col, bayerImage, R, G, B);
+        Store(dst, R, G, B, shift);
+        dst += colStep;
+    }
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+    return dst;
+}
 
-                GBRG2RGB_BI(row, col, bayerImage, R, G, B);
+/*
+ * 2x2 bayer interior span, the columns are walked in pairs so the tile
+ * position of both pixels is a compile time constant
+ */
+template <class L, int Y, bool GreenOnly,
+          void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int)>
+static inline uint8_t *_bayer2x2RGB_Row(const BayerImageData &bayerImage, int row,
+                                        int colBegin, int colEnd, int shift,
+                                        uint8_t *dst, ptrdiff_t colStep)
+{
+    uint16_t R, G, B;
+    int col = colBegin;
+
+    if ((col & 1) && col < colEnd) {
+        Bayer2RGB_BI_Site<L, Y, 1, GreenOnly, false>(row, col, bayerImage, R, G, B);
+        Store(dst, R, G, B, shift);
+        dst += colStep;
+        col++;
+    }
+    for (; col + 1 < colEnd; col += 2) {
+        Bayer2RGB_BI_Site<L, Y, 0, GreenOnly, false>(row, col, bayerImage, R, G, B);
+        Store(dst, R, G, B, shift);
+        dst += colStep;
+        Bayer2RGB_BI_Site<L, Y, 1, GreenOnly, false>(row, col + 1, bayerImage, R, G, B);
+        Store(dst, R, G, B, shift);
+        dst += colStep;
+    }
+    if (col < colEnd) {
+        Bayer2RGB_BI_Site<L, Y, 0, GreenOnly, false>(row, col, bayerImage, R, G, B);
+        Store(dst, R, G, B, shift);
+        dst += colStep;
+    }
+
+    return dst;
+}
+
+template <class L, bool GreenOnly,
+          void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int)>
+static uint8_t *_bayer2x2RGB_Span(const BayerImageData &bayerImage, int row,
+                                  int colBegin, int colEnd, int shift,
+                                  uint8_t *dst, ptrdiff_t colStep)
+{
+    if (row & 1)
+        return _bayer2x2RGB_Row<L, 1, GreenOnly, Store>(bayerImage, row, colBegin, colEnd,
+                                                        shift, dst, colStep);
+
+    return _bayer2x2RGB_Row<L, 0, GreenOnly, Store>(bayerImage, row, colBegin, colEnd,
+                                                    shift, dst, colStep);
+}
+
+/*
+ * EdgeSpan clamps the neighbourhood to the image, InnerSpan is the same
+ * kernel without the clamp for the interior pixels
+ */
+template <CFA2RGBSpanFunc EdgeSpan, CFA2RGBSpanFunc InnerSpan>
+static void _bayer2RGB_Block(const BayerImageData &bayerImage,
+                             const ImageRect &block, int shift,
+                             const OutputMapping &m)
+{
+    /* the stores may alias the rect and the image, keep the bounds local */
+    const int rowBegin = block.y;
+    const int rowEnd = block.y + block.height;
+    const int colBegin = block.x;
+    const int colEnd = block.x + block.width;
+    const int innerRowEnd = bayerImage.height - KERNEL_RADIUS;
+    const int innerBegin = CLAMP(KERNEL_RADIUS, colBegin, colEnd);
+    const int innerEnd = CLAMP(bayerImage.width - KERNEL_RADIUS, innerBegin, colEnd);
+    const ptrdiff_t colStep = m.colStep;
+
+    for (int row = rowBegin; row < rowEnd; row++) {
+        uint8_t *dst = m.origin + row * m.rowStep + colBegin * colStep;
+
+        if (row < KERNEL_RADIUS || row >= innerRowEnd) {
+            EdgeSpan(bayerImage, row, colBegin, colEnd, shift, dst, colStep);
+            continue;
+        }
+
+        dst = EdgeSpan(bayerImage, row, colBegin, innerBegin, shift, dst, colStep);
+        dst = InnerSpan(bayerImage, row, innerBegin, innerEnd, shift, dst, colStep);
+        EdgeSpan(bayerImage, row, innerEnd, colEnd, shift, dst, colStep);
+    }
+}
 
-                rgbLineBuf[col * 3]     = CLAMP((R >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 1] = CLAMP((G >> shift), 0, 255);
-                rgbLineBuf[col * 3 + 2] = CLAMP((B >> shift), 0, 255);
+/* fallback for the layouts without an instantiated kernel */
+template <void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int), bool GreenOnly>
+static void _cfa2RGB_GenericBlock(const BayerImageData &bayerImage,
+                                  const CFANeighbourTable &table,
+                                  const ImageRect &block, int shift,
+                                  const OutputMapping &m)
+{
+    const int P = table.period;
+    const int rowBegin = block.y;
+    const int rowEnd = block.y + block.height;
+    const int colBegin = block.x;
+    const int colEnd = block.x + block.width;
+
+    for (int row = rowBegin; row < rowEnd; row++) {
+        uint8_t *dst = m.origin + row * m.rowStep + colBegin * m.colStep;
+
+        for (int col = colBegin; col < colEnd; col++) {
+            int phase = (row % P) * P + col % P;
+            uint16_t RGB[3];
+
+            for (int c = GreenOnly ? CFA_COLOR_G : CFA_COLOR_R;
+                 c <= (GreenOnly ? CFA_COLOR_G : CFA_COLOR_B); c++) {
+                int count = table.count[phase][c];
+                uint32_t sum = 0;
+
+                for (int i = 0; i < count; i++)
+                    sum += bayerAt<true>(bayerImage, col + table.dx[phase][c][i],
+                                   row + table.dy[phase][c][i], P);
+                RGB[c] = count ? sum / count : 0;
             }
+
+            Store(dst, RGB[CFA_COLOR_R], RGB[CFA_COLOR_G], RGB[CFA_COLOR_B], shift);
+            dst += m.colStep;
         }
     }
+}
 
-    return 0;
+template <class L, void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int),
+          bool GreenOnly>
+static void _bayer2x2RGB_Block(const BayerImageData &bayerImage, const ImageRect &block,
+                               int shift, const OutputMapping &m)
+{
+    _bayer2RGB_Block<_bayer2RGB_Span<Bayer2RGB_BI<L, GreenOnly, true>, Store>,
+                     _bayer2x2RGB_Span<L, GreenOnly, Store> >(bayerImage, block, shift, m);
+}
+
+template <class L, void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int),
+          bool GreenOnly>
+static void _cfa4x4RGB_Block(const BayerImageData &bayerImage, const ImageRect &block,
+                             int shift, const OutputMapping &m)
+{
+    _bayer2RGB_Block<_bayer2RGB_Span<CFA4x42RGB_NI<L, GreenOnly, true>, Store>,
+                     _bayer2RGB_Span<CFA4x42RGB_NI<L, GreenOnly, false>, Store> >(bayerImage, block,
+                                                                                  shift, m);
+}
+
+template <void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int), bool GreenOnly>
+static void _cfa2RGB_Block(const BayerImageData &bayerImage,
+                           CFAKernel_e kernel, const CFANeighbourTable &table,
+                           const ImageRect &block, int shift,
+                           const OutputMapping &m)
+{
+    switch (kernel) {
+    case KERNEL_BAYER_RGGB:
+        _bayer2x2RGB_Block<CFALayout<2, CFA_LAYOUT_RGGB>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_BAYER_BGGR:
+        _bayer2x2RGB_Block<CFALayout<2, CFA_LAYOUT_BGGR>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_BAYER_GRBG:
+        _bayer2x2RGB_Block<CFALayout<2, CFA_LAYOUT_GRBG>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_BAYER_GBRG:
+        _bayer2x2RGB_Block<CFALayout<2, CFA_LAYOUT_GBRG>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_QUAD_RGGB:
+        _cfa4x4RGB_Block<CFALayout<4, CFA_LAYOUT_QUAD_RGGB>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_QUAD_BGGR:
+        _cfa4x4RGB_Block<CFALayout<4, CFA_LAYOUT_QUAD_BGGR>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_QUAD_GRBG:
+        _cfa4x4RGB_Block<CFALayout<4, CFA_LAYOUT_QUAD_GRBG>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_QUAD_GBRG:
+        _cfa4x4RGB_Block<CFALayout<4, CFA_LAYOUT_QUAD_GBRG>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_RGBW:
+        _cfa4x4RGB_Block<CFALayout<4, CFA_LAYOUT_RGBW>, Store, GreenOnly>(bayerImage, block, shift, m);
+        break;
+    case KERNEL_GENERIC:
+    default:
+        _cfa2RGB_GenericBlock<Store, GreenOnly>(bayerImage, table, block, shift, m);
+        break;
+    }
+}
+
+/* size of the last level cache, in bytes */
+static size_t _read_llc_size()
+{
+    long size = -1;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size <= 0)
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+
+    return size > 0 ? size : DEFAULT_LLC_SIZE;
+}
+
+static size_t _get_llc_size()
+{
+    static const size_t llcSize = _read_llc_size();
+
+    return llcSize;
 }
 
 /*
- * 32bit RGB format  32-bit RGB format (0xffRRGGBB)
+ * copy a row to the RGB image with non-temporal stores, the row bypasses
+ * the cache so it does not evict the bayer lines still to be read
  */
-int Demosaic::bayer2RGB32_BilinearInterpolation(const BayerImageData &bayerImage,
-                              BayerCFAPattern_e cfa,
-                              RGBImageData &rgbImage) const
+static void _stream_copy(uint8_t *dst, const uint8_t *src, size_t size)
+{
+#ifdef __SSE2__
+    while (size && (reinterpret_cast<uintptr_t>(dst) & 15)) {
+        *dst++ = *src++;
+        size--;
+    }
+    for (; size >= 16; size -= 16, src += 16, dst += 16)
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst),
+                         _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+#endif
+    memcpy(dst, src, size);
+}
+
+template <void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int), bool GreenOnly>
+static void _cfa2RGB_Rect(const BayerImageData &bayerImage,
+                          CFAKernel_e kernel, const CFANeighbourTable &table,
+                          const ImageRect &rect, ImageOrientation_e orientation,
+                          bool streaming, int bpp, int shift,
+                          const OutputMapping &m)
+{
+    /*
+     * streaming stores: each row is converted into a line buffer which
+     * stays in L1, then written out with non-temporal stores. Only for
+     * the orientations which write the rows contiguously.
+     */
+    const int rowBegin = rect.y;
+    const int rowEnd = rect.y + rect.height;
+    const int colBegin = rect.x;
+    const int colEnd = rect.x + rect.width;
+
+    if (streaming && (m.colStep == bpp || m.colStep == -bpp)) {
+        std::vector<uint8_t> lineBuf(rect.width * bpp);
+        OutputMapping lineMapping;
+
+        /* (row, col) lands at (col - rect.x) or its mirror in lineBuf */
+        lineMapping.rowStep = 0;
+        lineMapping.colStep = m.colStep;
+        lineMapping.origin = m.colStep > 0
+            ? lineBuf.data() - colBegin * bpp
+            : lineBuf.data() + (colEnd - 1) * bpp;
+
+        for (int row = rowBegin; row < rowEnd; row++) {
+            ImageRect line(colBegin, row, colEnd - colBegin, 1);
+            int firstCol = m.colStep > 0 ? colBegin : colEnd - 1;
+
+            _cfa2RGB_Block<Store, GreenOnly>(bayerImage, kernel, table, line, shift, lineMapping);
+            _stream_copy(m.origin + row * m.rowStep + firstCol * m.colStep,
+                         lineBuf.data(), lineBuf.size());
+        }
+#ifdef __SSE2__
+        /* make the non-temporal stores visible before returning */
+        _mm_sfence();
+#endif
+
+        return;
+    }
+
+    /*
+     * 90 and 270 degrees write the RGB image column by column, split the
+     * rect into blocks so that the RGB rows touched by a block stay in
+     * the cache until they are filled, the other orientations write
+     * whole rows and need no blocking.
+     */
+    int blockSize = (orientation == ORIENTATION_ROTATE_90
+                     || orientation == ORIENTATION_ROTATE_270)
+        ? ROTATE_BLOCK_SIZE : MAX(rect.width, rect.height);
+
+    for (int y = rowBegin; y < rowEnd; y += blockSize) {
+        for (int x = colBegin; x < colEnd; x += blockSize) {
+            ImageRect block(x, y, MIN(blockSize, colEnd - x), MIN(blockSize, rowEnd - y));
+
+            _cfa2RGB_Block<Store, GreenOnly>(bayerImage, kernel, table, block, shift, m);
+        }
+    }
+}
+
+template <void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int),
+          bool GreenOnly = false>
+static int _bayer2RGB_BilinearInterpolation(const BayerImageData &bayerImage,
+                                            const CFADescriptor &cfa,
+                                            const ImageRect &rect,
+                                            ImageOrientation_e orientation,
+                                            Demosaic::StreamingStore streamingStore,
+                                            const RawDenoise *denoise,
+                                            int bpp, RGBImageData &rgbImage)
 {
     int shift = _get_output_shift(bayerImage.format);
 
     if (shift < 0)
         return -1;
 
-    if (cfa == BAYER_CFA_RGGB) {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint32_t *rgbLineBuf = reinterpret_cast<uint32_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+    /* AUTO: the written region, not the whole RGB image, against the LLC */
+    bool streaming = streamingStore == Demosaic::STREAMING_STORE_ON
+        || (streamingStore == Demosaic::STREAMING_STORE_AUTO
+            && static_cast<size_t>(rect.width) * rect.height * bpp > _get_llc_size());
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+    OutputMapping m = _get_output_mapping(orientation, bayerImage.width,
+                                          bayerImage.height, bpp, rgbImage);
+    CFAKernel_e kernel = _select_kernel(cfa);
+    CFANeighbourTable table;
 
-                RGGB2RGB_BI(row, col, bayerImage, R, G, B);
+    if (kernel == KERNEL_GENERIC)
+        _build_neighbour_table(cfa, table);
 
-                R = CLAMP((R >> shift), 0, 255);
-                G = CLAMP((G >> shift), 0, 255);
-                B = CLAMP((B >> shift), 0, 255);
-                rgbLineBuf[col] = (0xff000000 | (R << 16) | (G << 8) | B);
-            }
-        }
-    } else if (cfa == BAYER_CFA_BGGR) {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint32_t *rgbLineBuf = reinterpret_cast<uint32_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+    if (denoise == nullptr) {
+        _cfa2RGB_Rect<Store, GreenOnly>(bayerImage, kernel, table, rect, orientation,
+                                        streaming, bpp, shift, m);
+        return 0;
+    }
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+    /*
+     * fused denoise: the rows of a band and a halo covering the kernel
+     * neighbourhood are denoised into the scratch, which starts on a CFA
+     * period so its phase is the one of the image. The kernel runs on the
+     * scratch with the output origin moved by the scratch first row.
+     */
+    const int P = cfa.period;
+    const int halo = P * ((KERNEL_RADIUS + P - 1) / P);
+    const int bandHeight = MAX(denoise->bandHeight(), 1);
+    int bytes = bayerImage.format == FORMAT_RAW8 ? 1 : 2;
+
+    BayerImageData scratch = bayerImage;
+    scratch.stride = bayerImage.width * bytes;
+    std::vector<uint8_t> scratchBuf((bandHeight + 2 * halo + P) * scratch.stride);
+    scratch.imageData = scratchBuf.data();
+
+    for (int y = rect.y; y < rect.y + rect.height; y += bandHeight) {
+        int rows = MIN(bandHeight, rect.y + rect.height - y);
+        int first = y - halo > 0 ? (y - halo) / P * P : 0;
+        int last = MIN(y + rows + halo, bayerImage.height);
+
+        scratch.height = last - first;
+        if (denoise->denoiseRows(bayerImage, cfa, first, scratch.height, scratch))
+            return -1;
 
-                BGGR2RGB_BI(row, col, bayerImage, R, G, B);
+        OutputMapping bandMapping = m;
+        bandMapping.origin += first * m.rowStep;
 
-                R = CLAMP((R >> shift), 0, 255);
-                G = CLAMP((G >> shift), 0, 255);
-                B = CLAMP((B >> shift), 0, 255);
-                rgbLineBuf[col] = (0xff000000 | (R << 16) | (G << 8) | B);
-            }
-        }
-    } else if (cfa == BAYER_CFA_GRBG) {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint32_t *rgbLineBuf = reinterpret_cast<uint32_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+        _cfa2RGB_Rect<Store, GreenOnly>(scratch, kernel, table,
+                                        ImageRect(rect.x, y - first, rect.width, rows),
+                                        orientation, streaming, bpp, shift, bandMapping);
+    }
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+    return 0;
+}
 
-                GRBG2RGB_BI(row, col, bayerImage, R, G, B);
+int Demosaic::bayer2RGB_BilinearInterpolation(const BayerImageData &bayerImage,
+                              const CFADescriptor &cfa,
+                              const ImageRect &rect,
+                              RGBImageData &rgbImage) const
+{
+    switch (rgbImage.format) {
+    case FORMAT_RGB888:
+        return _bayer2RGB_BilinearInterpolation<_store_RGB888>(bayerImage, cfa, rect,
+                                                               m_orientation, m_streamingStore,
+                                                               m_rawDenoise, 3, rgbImage);
+    case FORMAT_RGB32:
+    case FORMAT_ARGB32:
+        return _bayer2RGB_BilinearInterpolation<_store_RGB32>(bayerImage, cfa, rect,
+                                                              m_orientation, m_streamingStore,
+                                                              m_rawDenoise, 4, rgbImage);
+    case FORMAT_RGBA8888:
+        return _bayer2RGB_BilinearInterpolation<_store_RGBA8888>(bayerImage, cfa, rect,
+                                                                 m_orientation, m_streamingStore,
+                                                                 m_rawDenoise, 4, rgbImage);
+    case FORMAT_GRAY8:
+        if (m_lumaMode == LUMA_GREEN)
+            return _bayer2RGB_BilinearInterpolation<_store_G8, true>(bayerImage, cfa, rect,
+                                                                     m_orientation, m_streamingStore,
+                                                                     m_rawDenoise, 1, rgbImage);
+        return _bayer2RGB_BilinearInterpolation<_store_Y8>(bayerImage, cfa, rect,
+                                                           m_orientation, m_streamingStore,
+                                                           m_rawDenoise, 1, rgbImage);
+    case FORMAT_GRAY16:
+        if (m_lumaMode == LUMA_GREEN)
+            return _bayer2RGB_BilinearInterpolation<_store_G16, true>(bayerImage, cfa, rect,
+                                                                      m_orientation, m_streamingStore,
+                                                                      m_rawDenoise, 2, rgbImage);
+        return _bayer2RGB_BilinearInterpolation<_store_Y16>(bayerImage, cfa, rect,
+                                                            m_orientation, m_streamingStore,
+                                                            m_rawDenoise, 2, rgbImage);
+    default:
+        std::cout << "Unsupport rgb format " << rgbImage.format << std::endl;
+        return -1;
+    }
+}
 
-                R = CLAMP((R >> shift), 0, 255);
-                G = CLAMP((G >> shift), 0, 255);
-                B = CLAMP((B >> shift), 0, 255);
-                rgbLineBuf[col] = (0xff000000 | (R << 16) | (G << 8) | B);
-            }
+/*
+ * planar kernel
+ *
+ * the bayer pixel (2i + Y, 2j + X) is the site (Y, X) of the quad (i, j),
+ * its neighbour (DY, DX) is read from the plane of the site
+ * ((Y + DY) & 1, (X + DX) & 1) in the quad (i + floor((Y + DY) / 2),
+ * j + floor((X + DX) / 2)). Clamping the plane row/column at the border
+ * is the same as the 2 pixels mirror of bayerAt, so the output is
+ * identical to the interleaved kernel.
+ */
+#define PLANAR_CHUNK 256
+
+struct PlaneRows {
+    const uint16_t *rows[BAYER_PLANE_COUNT][3];     /* plane rows i - 1, i, i + 1 */
+    int last;                                       /* last plane column */
+};
+
+static constexpr int _floor_half(int v)
+{
+    return v >= 0 ? v / 2 : -((1 - v) / 2);
+}
+
+template <class L>
+static constexpr int _plane_at(int y, int x)
+{
+    return L::at(y, x) == CFA_COLOR_R ? BAYER_PLANE_R
+        : L::at(y, x) == CFA_COLOR_B ? BAYER_PLANE_B
+        : L::at(y, x ^ 1) == CFA_COLOR_R ? BAYER_PLANE_GR : BAYER_PLANE_GB;
+}
+
+template <class L, int Y, int X, int DY, int DX, bool Edge>
+static inline uint16_t PL_At(const PlaneRows &p, int j)
+{
+    int col = j + _floor_half(X + DX);
+
+    if (Edge)
+        col = CLAMP(col, 0, p.last);
+
+    return p.rows[_plane_at<L>((Y + DY) & 1, (X + DX) & 1)][_floor_half(Y + DY) + 1][col];
+}
+
+/* same interpolation as BI_Pixel_R/Gr/Gb/B */
+template <class L, int Y, int X, bool GreenOnly, bool Edge>
+static inline void PL_Pixel(const PlaneRows &p, int j,
+                            uint16_t &R, uint16_t &G, uint16_t &B)
+{
+#define AT(dy, dx) PL_At<L, Y, X, dy, dx, Edge>(p, j)
+
+    if (L::at(Y, X) == CFA_COLOR_G) {
+        G = AT(0, 0);
+        if (GreenOnly)
+            return;
+
+        if (L::at(Y, X ^ 1) == CFA_COLOR_R) {
+            R = static_cast<uint32_t>(AT(0, -1) + AT(0, 1)) / 2;
+            B = static_cast<uint32_t>(AT(-1, 0) + AT(1, 0)) / 2;
+        } else {
+            R = static_cast<uint32_t>(AT(-1, 0) + AT(1, 0)) / 2;
+            B = static_cast<uint32_t>(AT(0, -1) + AT(0, 1)) / 2;
         }
     } else {
-        for (int row = 0; row < bayerImage.height; row++) {
-            uint32_t *rgbLineBuf = reinterpret_cast<uint32_t *>((intptr_t)rgbImage.imageData + row * rgbImage.stride);
+        int d13 = abs(AT(-2, 0) - AT(2, 0));
+        int d24 = abs(AT(0, 2) - AT(0, -2));
+        uint32_t G1 = AT(-1, 0), G2 = AT(0, 1), G3 = AT(1, 0), G4 = AT(0, -1);
+
+        G = d13 < d24 ? (G1 + G3) / 2
+            : d13 > d24 ? (G2 + G4) / 2 : (G1 + G2 + G3 + G4) / 4;
+        if (GreenOnly)
+            return;
+
+        uint16_t C = AT(0, 0);
+        uint16_t D = static_cast<uint32_t>(AT(-1, -1) + AT(-1, 1)
+                                           + AT(1, 1) + AT(1, -1)) / 4;
+
+        if (L::at(Y, X) == CFA_COLOR_R) {
+            R = C;
+            B = D;
+        } else {
+            R = D;
+            B = C;
+        }
+    }
 
-            for (int col = 0; col < bayerImage.width; col++) {
-                uint16_t R, G, B;
+#undef AT
+}
+
+struct PlanarQuads {
+    uint16_t v[4][3][PLANAR_CHUNK];     /* [site][R, G, B][quad] */
+};
+
+template <class L, bool GreenOnly, bool Edge>
+static inline void PL_Quad(const PlaneRows &p, int j, PlanarQuads &q, int k)
+{
+    PL_Pixel<L, 0, 0, GreenOnly, Edge>(p, j, q.v[0][0][k], q.v[0][1][k], q.v[0][2][k]);
+    PL_Pixel<L, 0, 1, GreenOnly, Edge>(p, j, q.v[1][0][k], q.v[1][1][k], q.v[1][2][k]);
+    PL_Pixel<L, 1, 0, GreenOnly, Edge>(p, j, q.v[2][0][k], q.v[2][1][k], q.v[2][2][k]);
+    PL_Pixel<L, 1, 1, GreenOnly, Edge>(p, j, q.v[3][0][k], q.v[3][1][k], q.v[3][2][k]);
+}
 
-                GBRG2RGB_BI(row, col, bayerImage, R, G, B);
+template <class L, void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int),
+          bool GreenOnly>
+static void _planar2RGB_Rows(const BayerPlanarImageData &planar,
+                             const ImageRect &rect, int shift,
+                             const OutputMapping &m)
+{
+    PlanarQuads q;
+    PlaneRows p;
+
+    p.last = planar.planeWidth - 1;
+
+    const int rowBegin = rect.y;
+    const int rowEnd = rect.y + rect.height;
+    const int colBegin = rect.x;
+    const int colEnd = rect.x + rect.width;
+    int i0 = rowBegin / 2;
+    int i1 = (rowEnd + 1) / 2;
+    int j0 = colBegin / 2;
+    int j1 = (colEnd + 1) / 2;
+
+    for (int i = i0; i < i1; i++) {
+        for (int plane = 0; plane < BAYER_PLANE_COUNT; plane++) {
+            for (int k = 0; k < 3; k++)
+                p.rows[plane][k] = planar.planeRow(plane,
+                                                   CLAMP(i + k - 1, 0, planar.planeHeight - 1));
+        }
 
-                R = CLAMP((R >> shift), 0, 255);
-                G = CLAMP((G >> shift), 0, 255);
-                B = CLAMP((B >> shift), 0, 255);
-                rgbLineBuf[col] = (0xff000000 | (R << 16) | (G << 8) | B);
+        for (int jc = j0; jc < j1; jc += PLANAR_CHUNK) {
+            int count = MIN(PLANAR_CHUNK, j1 - jc);
+
+            /*
+             * the interior quads need no column clamp, their loop reads
+             * each plane with unit stride and is vectorized
+             */
+            int k = 0;
+            for (; k < count && jc + k == 0; k++)
+                PL_Quad<L, GreenOnly, true>(p, jc + k, q, k);
+            int interior = MIN(count, p.last - jc);
+            for (; k < interior; k++)
+                PL_Quad<L, GreenOnly, false>(p, jc + k, q, k);
+            for (; k < count; k++)
+                PL_Quad<L, GreenOnly, true>(p, jc + k, q, k);
+
+            for (int site = 0; site < 4; site++) {
+                int row = 2 * i + (site >> 1);
+
+                if (row < rowBegin || row >= rowEnd)
+                    continue;
+
+                for (k = 0; k < count; k++) {
+                    int col = 2 * (jc + k) + (site & 1);
+
+                    if (col < colBegin || col >= colEnd)
+                        continue;
+
+                    Store(m.origin + row * m.rowStep + col * m.colStep,
+                          q.v[site][0][k], q.v[site][1][k], q.v[site][2][k], shift);
+                }
             }
         }
     }
+}
+
+template <void (*Store)(uint8_t *, uint16_t, uint16_t, uint16_t, int),
+          bool GreenOnly = false>
+static int _planar2RGB(const BayerPlanarImageData &planar, const ImageRect &rect,
+                       ImageOrientation_e orientation, int bpp,
+                       RGBImageData &rgbImage)
+{
+    int shift = planar.bits - 8;
+
+    if (shift < 0) {
+        std::cout << "Invalid planar bits " << planar.bits << std::endl;
+        return -1;
+    }
+
+    OutputMapping m = _get_output_mapping(orientation, planar.width,
+                                          planar.height, bpp, rgbImage);
+
+    switch (planar.cfa) {
+    case BAYER_CFA_RGGB:
+        _planar2RGB_Rows<CFALayout<2, CFA_LAYOUT_RGGB>, Store, GreenOnly>(planar, rect, shift, m);
+        break;
+    case BAYER_CFA_BGGR:
+        _planar2RGB_Rows<CFALayout<2, CFA_LAYOUT_BGGR>, Store, GreenOnly>(planar, rect, shift, m);
+        break;
+    case BAYER_CFA_GRBG:
+        _planar2RGB_Rows<CFALayout<2, CFA_LAYOUT_GRBG>, Store, GreenOnly>(planar, rect, shift, m);
+        break;
+    case BAYER_CFA_GBRG:
+        _planar2RGB_Rows<CFALayout<2, CFA_LAYOUT_GBRG>, Store, GreenOnly>(planar, rect, shift, m);
+        break;
+    default:
+        std::cout << "Invalid planar cfa " << planar.cfa << std::endl;
+        return -1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int Demosaic::planar2RGB(const BayerPlanarImageData &planar,
+                         RGBImageData &rgbImage) const
+{
+    ImageRect rect(0, 0, planar.width, planar.height);
+
+    return planar2RGBRegion(planar, rect, rgbImage);
+}
+
+int Demosaic::planar2RGBRegion(const BayerPlanarImageData &planar,
+                               const ImageRect &rect,
+                               RGBImageData &rgbImage) const
+{
+    if (m_rawDenoise) {
+        std::cout << "Raw denoise is not supported on the planar path" << std::endl;
+        return -1;
+    }
+    if (!checkRegion(planar.width, planar.height, rect, rgbImage))
+        return -1;
+
+    switch (rgbImage.format) {
+    case FORMAT_RGB888:
+        return _planar2RGB<_store_RGB888>(planar, rect, m_orientation, 3, rgbImage);
+    case FORMAT_RGB32:
+    case FORMAT_ARGB32:
+        return _planar2RGB<_store_RGB32>(planar, rect, m_orientation, 4, rgbImage);
+    case FORMAT_RGBA8888:
+        return _planar2RGB<_store_RGBA8888>(planar, rect, m_orientation, 4, rgbImage);
+    case FORMAT_GRAY8:
+        if (m_lumaMode == LUMA_GREEN)
+            return _planar2RGB<_store_G8, true>(planar, rect, m_orientation, 1, rgbImage);
+        return _planar2RGB<_store_Y8>(planar, rect, m_orientation, 1, rgbImage);
+    case FORMAT_GRAY16:
+        if (m_lumaMode == LUMA_GREEN)
+            return _planar2RGB<_store_G16, true>(planar, rect, m_orientation, 2, rgbImage);
+        return _planar2RGB<_store_Y16>(planar, rect, m_orientation, 2, rgbImage);
+    default:
+        std::cout << "Unsupport rgb format " << rgbImage.format << std::endl;
+        return -1;
+    }
+}
@@ -12,40 +12,142 @@
 
 BEGIN_NAMESPACE_ISP
 
+class RawDenoise;
+
 /**
  * @brief demosaic algorithm
  */
-class Demosaic {
+class ISP_EXPORT Demosaic {
 
 public:
     enum DemosaicInterPolation {
         BILINEAR_INTERPOLATION = 0,
     };
 
+    enum LumaMode {
+        LUMA_WEIGHTED = 0,  /*!< BT.601 weighted sum of the interpolated R, G, B */
+        LUMA_GREEN,         /*!< interpolate G only */
+    };
+
+    enum StreamingStore {
+        STREAMING_STORE_AUTO = 0,   /*!< when the converted region exceeds the last level cache */
+        STREAMING_STORE_ON,
+        STREAMING_STORE_OFF,
+    };
+
     Demosaic();
     Demosaic(enum DemosaicInterPolation);
 
     /**
      * @brief convert bayer image to RGB image
-     * @details support RGB888 and RGB32 format
+     * @details support all the RGBFormat_e formats, the alpha of ARGB32
+     *          and RGBA8888 is opaque, GRAY8/GRAY16 write a single luma
+     *          plane computed as selected by setLumaMode()
      * @param[in]  bayerImage
-     * @param[in]  cfa
+     * @param[in]  cfa         a BayerCFAPattern_e converts implicitly, the
+     *                         2x2 bayer, quad bayer and RGBW layouts have
+     *                         dedicated kernels, any other periodic layout
+     *                         uses a generic one
      * @param[out] rgbImage
      */
-    int bayer2RGB(const BayerImageData &bayerImage, BayerCFAPattern_e cfa,
+    int bayer2RGB(const BayerImageData &bayerImage, const CFADescriptor &cfa,
                    RGBImageData &rgbImage) const;
 
+    /**
+     * @brief select how the GRAY8/GRAY16 output is computed
+     * @details LUMA_GREEN skips the R and B interpolation, which is
+     *          cheaper than LUMA_WEIGHTED
+     */
+    void setLumaMode(LumaMode mode) { m_lumaMode = mode; }
+    LumaMode lumaMode() const { return m_lumaMode; }
+
+    /**
+     * @brief use non-temporal stores for the RGB output
+     * @details the streamed RGB rows bypass the cache and do not evict
+     *          the bayer lines the kernel still reads, only used for the
+     *          orientations which write whole rows (not 90/270 degrees)
+     */
+    void setStreamingStore(StreamingStore mode) { m_streamingStore = mode; }
+    StreamingStore streamingStore() const { return m_streamingStore; }
+
+    /**
+     * @brief denoise the bayer image inside bayer2RGB()/bayer2RGBRegion()
+     * @details the image is converted in bands of denoise->bandHeight()
+     *          rows, each band and a halo of rows around it are filtered
+     *          into a scratch buffer read by the kernel, so the filter
+     *          adds no full frame memory pass. The denoise is not owned,
+     *          nullptr (default) disables it. planar2RGB() fails while
+     *          it is set.
+     */
+    void setRawDenoise(const RawDenoise *denoise) { m_rawDenoise = denoise; }
+    const RawDenoise *rawDenoise() const { return m_rawDenoise; }
+
+    /**
+     * @brief set the orientation of the RGB output
+     * @details the pixels are written directly to their rotated/mirrored
+     *          position, for 90 and 270 degrees the RGB image is
+     *          height x width of the bayer image
+     */
+    void setOrientation(ImageOrientation_e orientation) { m_orientation = orientation; }
+    ImageOrientation_e orientation() const { return m_orientation; }
+
+    /**
+     * @brief map a rect of the bayer image to where it is written in the
+     *        RGB image with the current orientation
+     * @param[in] rect    rect in bayer image coordinates
+     * @param[in] width   bayer image width
+     * @param[in] height  bayer image height
+     */
+    ImageRect outputRect(const ImageRect &rect, int width, int height) const;
+
+    /**
+     * @brief convert a rectangle of the bayer image to RGB
+     * @details only the pixels inside rect are written to rgbImage, the
+     *          pixels around the rect are still read as the interpolation
+     *          neighbourhood, so the result is identical to the same area
+     *          of a full bayer2RGB()
+     * @param[in]  bayerImage
+     * @param[in]  cfa
+     * @param[in]  rect        area to convert, in bayer image coordinates,
+     *                         written to its rotated position in rgbImage
+     * @param[out] rgbImage
+     */
+    int bayer2RGBRegion(const BayerImageData &bayerImage, const CFADescriptor &cfa,
+                        const ImageRect &rect, RGBImageData &rgbImage) const;
+
+    /**
+     * @brief convert a quad split bayer image to RGB image
+     * @details same result as bayer2RGB() on the interleaved image, the
+     *          planes are read with unit stride
+     * @param[in]  planar      see bayerSplitPlanes()
+     * @param[out] rgbImage
+     */
+    int planar2RGB(const BayerPlanarImageData &planar, RGBImageData &rgbImage) const;
+
+    /**
+     * @brief convert a rectangle of a quad split bayer image to RGB
+     * @param[in]  planar
+     * @param[in]  rect        area to convert, in bayer image coordinates
+     * @param[out] rgbImage
+     */
+    int planar2RGBRegion(const BayerPlanarImageData &planar, const ImageRect &rect,
+                         RGBImageData &rgbImage) const;
+
 private:
     enum DemosaicInterPolation m_interpolationMethod;
+    ImageOrientation_e m_orientation;
+    StreamingStore m_streamingStore;
+    LumaMode m_lumaMode;
+    const RawDenoise *m_rawDenoise;
     uint8_t *m_gammaLUT;
 
-    int bayer2RGB888_BilinearInterpolation(const BayerImageData &bayerImage,
-                                           BayerCFAPattern_e cfa,
-                                           RGBImageData &rgbImage) const;
+    bool checkRegion(int width, int height, const ImageRect &rect,
+                     const RGBImageData &rgbImage) const;
 
-    int bayer2RGB32_BilinearInterpolation(const BayerImageData &bayerImage,
-                                           BayerCFAPattern_e cfa,
-                                           RGBImageData &rgbImage) const;
+    int bayer2RGB_BilinearInterpolation(const BayerImageData &bayerImage,
+                                        const CFADescriptor &cfa,
+                                        const ImageRect &rect,
+                                        RGBImageData &rgbImage) const;
 };
 
 END_NAMESPACE_ISP
@@ -0,0 +1,169 @@
+/**
+ * @file raw_denoise.cpp
+ *
+ * @brief bayer domain denoise implement
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#include <cstdlib>
+#include <cstring>
+
+#include "raw_denoise.h"
+#include "parallel_bands.h"
+
+ISP_USE_NAMESPACE
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* i + d, or i - d when it is out of the image, or i */
+static inline int _neighbour(int i, int d, int size)
+{
+    int n = i + d;
+
+    if (n < 0 || n >= size)
+        n = i - d;
+    if (n < 0 || n >= size)
+        n = i;
+
+    return n;
+}
+
+/*
+ * the distance is clamped as an int, a float MAX would keep the compiler
+ * from vectorizing the row loop
+ */
+static inline float _tap(int c, int v, float spatial, int sigma, float invSigma,
+                         float &weightSum)
+{
+    int d = MIN(std::abs(v - c), sigma);
+    float w = spatial * (1.0f - d * invSigma);
+
+    weightSum += w;
+
+    return w * v;
+}
+
+template <typename T>
+static inline T _denoise_sample(const T *up, const T *mid, const T *down,
+                                int l, int x, int r, int shift, int sigma)
+{
+    float invSigma = 1.0f / sigma;
+    int c = mid[x] >> shift;
+    float weightSum = 1.0f;
+    float sum = c;
+
+    sum += _tap(c, up[l] >> shift, 0.25f, sigma, invSigma, weightSum);
+    sum += _tap(c, up[x] >> shift, 0.5f, sigma, invSigma, weightSum);
+    sum += _tap(c, up[r] >> shift, 0.25f, sigma, invSigma, weightSum);
+    sum += _tap(c, mid[l] >> shift, 0.5f, sigma, invSigma, weightSum);
+    sum += _tap(c, mid[r] >> shift, 0.5f, sigma, invSigma, weightSum);
+    sum += _tap(c, down[l] >> shift, 0.25f, sigma, invSigma, weightSum);
+    sum += _tap(c, down[x] >> shift, 0.5f, sigma, invSigma, weightSum);
+    sum += _tap(c, down[r] >> shift, 0.25f, sigma, invSigma, weightSum);
+
+    return static_cast<T>(static_cast<int>(sum / weightSum + 0.5f) << shift);
+}
+
+/*
+ * the columns away from the border are a unit stride loop without
+ * branches, vectorized by the compiler, the border columns are mirrored
+ */
+template <typename T>
+static void _denoise_row(const T *up, const T *mid, const T *down, T *dst,
+                         int width, int step, int shift, int sigma)
+{
+    int left = MIN(step, width);
+    int right = MAX(width - step, left);
+
+    for (int x = 0; x < left; x++)
+        dst[x] = _denoise_sample(up, mid, down, _neighbour(x, -step, width), x,
+                                 _neighbour(x, step, width), shift, sigma);
+    for (int x = left; x < right; x++)
+        dst[x] = _denoise_sample(up, mid, down, x - step, x, x + step, shift, sigma);
+    for (int x = right; x < width; x++)
+        dst[x] = _denoise_sample(up, mid, down, _neighbour(x, -step, width), x,
+                                 _neighbour(x, step, width), shift, sigma);
+}
+
+RawDenoise::RawDenoise()
+    : m_rangeSigma (0.02f)
+    , m_threadCount (0)
+    , m_bandHeight (64)
+{
+}
+
+int RawDenoise::denoiseRows(const BayerImageData &input, const CFADescriptor &cfa,
+                            int firstRow, int rowCount, BayerImageData &output) const
+{
+    int bits = rawFormatBits(input.format);
+
+    if (bits < 0) {
+        std::cout << "Invalid bayer mem format " << input.format << std::endl;
+        return -1;
+    }
+    if (output.format != input.format || output.width != input.width
+        || output.height < rowCount || firstRow < 0
+        || firstRow + rowCount > input.height) {
+        std::cout << "Invalid denoise rows " << firstRow << "+" << rowCount
+            << " of " << input.width << "x" << input.height << std::endl;
+        return -1;
+    }
+
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(input.imageData);
+    uint8_t *dst = reinterpret_cast<uint8_t *>(output.imageData);
+    int bytes = input.format == FORMAT_RAW8 ? 1 : 2;
+
+    if (m_rangeSigma <= 0) {
+        for (int y = 0; y < rowCount; y++)
+            memcpy(dst + y * output.stride, src + (firstRow + y) * input.stride,
+                   input.width * bytes);
+        return 0;
+    }
+
+    int shift = rawFormatUnpackShift(input.format);
+    int sigma = MAX(static_cast<int>(m_rangeSigma * ((1 << bits) - 1) + 0.5f), 1);
+    int step = cfa.period;
+
+    for (int y = firstRow; y < firstRow + rowCount; y++) {
+        const uint8_t *up = src + _neighbour(y, -step, input.height) * input.stride;
+        const uint8_t *mid = src + y * input.stride;
+        const uint8_t *down = src + _neighbour(y, step, input.height) * input.stride;
+        uint8_t *row = dst + (y - firstRow) * output.stride;
+
+        if (bytes == 1)
+            _denoise_row(up, mid, down, row, input.width, step, shift, sigma);
+        else
+            _denoise_row(reinterpret_cast<const uint16_t *>(up),
+                         reinterpret_cast<const uint16_t *>(mid),
+                         reinterpret_cast<const uint16_t *>(down),
+                         reinterpret_cast<uint16_t *>(row),
+                         input.width, step, shift, sigma);
+    }
+
+    return 0;
+}
+
+int RawDenoise::denoise(const BayerImageData &input, const CFADescriptor &cfa,
+                        BayerImageData &output) const
+{
+    if (output.imageData == input.imageData || output.height != input.height) {
+        std::cout << "Denoise output must be another image of the input size" << std::endl;
+        return -1;
+    }
+
+    return parallelForBands(input.height, m_bandHeight, m_threadCount,
+                            [&](int y0, int rows) -> int {
+        BayerImageData band = output;
+
+        band.imageData = reinterpret_cast<uint8_t *>(output.imageData) + y0 * output.stride;
+        band.height = rows;
+
+        return denoiseRows(input, cfa, y0, rows, band);
+    });
+}
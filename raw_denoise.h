@@ -0,0 +1,79 @@
+/**
+ * @file raw_denoise.h
+ *
+ * @brief bayer domain denoise
+ *
+ * @author Dan.Cao <caodan@linuxtoy.cn>
+ */
+#ifndef RAWDENOISE_H
+#define RAWDENOISE_H
+
+#include "imagesignalprocessor.h"
+
+BEGIN_NAMESPACE_ISP
+
+/**
+ * @brief bilateral filter over the same color neighbours of the raw image
+ * @details every sample is averaged with the 8 samples one CFA period
+ *          away, which have its color for any periodic CFA. The spatial
+ *          weights are 1/2 for the sides and 1/4 for the corners, the
+ *          range weight falls linearly from 1 to 0 when the difference to
+ *          the center reaches the range sigma. The image borders are
+ *          mirrored by a CFA period.
+ */
+class ISP_EXPORT RawDenoise {
+
+public:
+    RawDenoise();
+
+    /**
+     * @brief difference at which a neighbour stops contributing
+     * @param[in] sigma  fraction of the full scale, default 0.02, 0 disables
+     *                   the filter
+     */
+    void setRangeSigma(float sigma) { m_rangeSigma = sigma; }
+    float rangeSigma() const { return m_rangeSigma; }
+
+    /**
+     * @brief threads used by denoise(), 0 (default) means one per cpu
+     */
+    void setThreadCount(int threadCount) { m_threadCount = threadCount; }
+
+    /**
+     * @brief rows of a band, of denoise() and of the demosaic fused filter
+     */
+    void setBandHeight(int bandHeight) { m_bandHeight = bandHeight; }
+    int bandHeight() const { return m_bandHeight; }
+
+    /**
+     * @brief denoise a whole image, in parallel bands
+     * @param[in]  input
+     * @param[in]  cfa
+     * @param[out] output  same size and format as input, not input itself
+     */
+    int denoise(const BayerImageData &input, const CFADescriptor &cfa,
+                BayerImageData &output) const;
+
+    /**
+     * @brief denoise rows of the image into a band buffer
+     * @details the neighbours are read from input, so the rows around the
+     *          band need not be filtered, this is how the demosaic fuses
+     *          the filter in its band scratch buffer
+     * @param[in]  input
+     * @param[in]  cfa
+     * @param[in]  firstRow  row of input written to row 0 of output
+     * @param[in]  rowCount
+     * @param[out] output    at least rowCount rows, input format and width
+     */
+    int denoiseRows(const BayerImageData &input, const CFADescriptor &cfa,
+                    int firstRow, int rowCount, BayerImageData &output) const;
+
+private:
+    float m_rangeSigma;
+    int m_threadCount;
+    int m_bandHeight;
+};
+
+END_NAMESPACE_ISP
+
+#endif // RAWDENOISE_H
@@ -11,5 +11,17 @@ WIDTH=1920
 HEIGHT=1080
 FORMAT=RAW10_UNPACKED
 CFA=RGGB
+TEST_DEMOSAIC=${TEST_DEMOSAIC:-./test_demosaic}
+RGB_FORMATS=${RGB_FORMATS:-RGB888}
 
-./test_demosaic -i ${INPUT_FILE} -o ${CFA}_${WIDTH}x${HEIGHT}.rgb -w ${WIDTH} -v ${HEIGHT} --format=${FORMAT} --cfa=${CFA}
+for RGB in ${RGB_FORMATS}; do
+    OUTPUT_FILE=${CFA}_${WIDTH}x${HEIGHT}.rgb
+    if [ "${RGB}" != "RGB888" ]; then
+        OUTPUT_FILE=${CFA}_${WIDTH}x${HEIGHT}_${RGB}.rgb
+    fi
+    ${TEST_DEMOSAIC} -i ${INPUT_FILE} -o ${OUTPUT_FILE} -w ${WIDTH} -v ${HEIGHT} --format=${FORMAT} --cfa=${CFA} --rgb=${RGB} || exit 1
+done
+
+for CHECK in incremental hdr numa planar denoise orientation scheduler; do
+    ${TEST_DEMOSAIC} --check=${CHECK} || exit 1
+done
@@ -8,10 +8,19 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cmath>
+#include <vector>
 #include <unistd.h>
 #include <getopt.h>
 
 #include "raw_bayer_demosaic.h"
+#include "bayer_planar.h"
+#include "raw_denoise.h"
+#include "demosaic_tuner.h"
+#include "incremental_demosaic.h"
+#include "hdr_merge.h"
+#include "demosaic_scheduler.h"
+#include "numa_affinity.h"
 
 ISP_USE_NAMESPACE
 
@@ -24,7 +33,17 @@ void show_usage(char *name)
     printf("   --stride,-s    image stride (bytes)\n");
     printf("   --height,-v    image height (pixels)\n");
     printf("   --format,-f    bayer mem format: RAW8, RAW10_UNPACKED, RAW12_UNPACKED, RAW14_UNPACKED, RAW16\n");
-    printf("   --cfa,-c       color filter array: RGGB, GBRG, GRBG, BGGR\n");
+    printf("   --cfa,-c       color filter array: RGGB, GBRG, GRBG, BGGR,\n");
+    printf("                  or the row major colors (R, G, B, W) of any periodic CFA,\n");
+    printf("                  e.g. RRGGRRGGGGBBGGBB (quad bayer), WRWGRWGWWGWBGWBW (RGBW)\n");
+    printf("   --rgb,-g       rgb output format: RGB888 (default), RGB32, ARGB32, RGBA8888, GRAY8, GRAY16\n");
+    printf("   --luma,-l      GRAY8/GRAY16 luma: WEIGHTED (default), GREEN\n");
+    printf("   --planar,-p    split to R/Gr/Gb/B planes and demosaic the planes (2x2 bayer only)\n");
+    printf("   --denoise,-n   raw denoise fused in the demosaic, range sigma in fraction of full scale, e.g. 0.02\n");
+    printf("   --tune,-t      use the tuned kernel and streaming store, calibrated on the first run\n");
+    printf("   --orientation,-r  output orientation: 0, 90, 180, 270, MIRROR_H, MIRROR_V\n");
+    printf("   --check,-k     run a self check instead of a conversion: incremental, hdr,\n");
+    printf("                  numa, planar, denoise, orientation, scheduler\n");
     printf("   --help,-h      this helpful message\n");
 }
 
@@ -35,7 +54,15 @@ struct test_demosaic_args {
     int height;
     int stride;
     BayerCFAPattern_e cfa;
+    char *cfaLayout;
     RawFormat_e rawFmt;
+    ImageOrientation_e orientation;
+    RGBFormat_e rgbFmt;
+    Demosaic::LumaMode lumaMode;
+    bool planar;
+    float denoise;
+    bool tune;
+    char *check;
 
     uint8_t *bayerData;
 };
@@ -106,12 +133,19 @@ static int parse_arg(int argc, char *argv[],
         {"stride", required_argument, NULL,'s'},
         {"format", required_argument, NULL,'f'},
         {"cfa",    required_argument, NULL,'c'},
+        {"rgb",    required_argument, NULL,'g'},
+        {"luma",   required_argument, NULL,'l'},
+        {"planar", no_argument,       NULL,'p'},
+        {"denoise", required_argument, NULL,'n'},
+        {"tune",   no_argument,       NULL,'t'},
+        {"check",  required_argument, NULL,'k'},
+        {"orientation", required_argument, NULL,'r'},
         {"help",   no_argument,       NULL,'h'},
         {0,0,0,0}
     };
 
     char c;
-    while ((c=getopt_long(argc,argv,"i:o:w:v:s:f:c:h",longopt,&optidx)) != -1) {
+    while ((c=getopt_long(argc,argv,"i:o:w:v:s:f:c:g:l:pn:tk:r:h",longopt,&optidx)) != -1) {
         switch (c) {
         case 'i':
             demosaic_arg->inFileName = strdup(optarg);
@@ -154,7 +188,74 @@ static int parse_arg(int argc, char *argv[],
             else if(strcmp(optarg, "GBRG") == 0)
                 demosaic_arg->cfa = BAYER_CFA_GBRG;
             else {
-                std::cout << "Invalid CFA " << optarg << std::endl;
+                CFADescriptor descriptor;
+
+                if (descriptor.init(optarg)) {
+                    std::cout << "Invalid CFA " << optarg << std::endl;
+                    return -1;
+                }
+                demosaic_arg->cfaLayout = strdup(optarg);
+            }
+            break;
+        case 'g':
+            if(strcmp(optarg, "RGB888") == 0)
+                demosaic_arg->rgbFmt = FORMAT_RGB888;
+            else if(strcmp(optarg, "RGB32") == 0)
+                demosaic_arg->rgbFmt = FORMAT_RGB32;
+            else if(strcmp(optarg, "ARGB32") == 0)
+                demosaic_arg->rgbFmt = FORMAT_ARGB32;
+            else if(strcmp(optarg, "RGBA8888") == 0)
+                demosaic_arg->rgbFmt = FORMAT_RGBA8888;
+            else if(strcmp(optarg, "GRAY8") == 0)
+                demosaic_arg->rgbFmt = FORMAT_GRAY8;
+            else if(strcmp(optarg, "GRAY16") == 0)
+                demosaic_arg->rgbFmt = FORMAT_GRAY16;
+            else {
+                std::cout << "Invalid rgb format " << optarg << std::endl;
+                return -1;
+            }
+            break;
+        case 'l':
+            if(strcmp(optarg, "WEIGHTED") == 0)
+                demosaic_arg->lumaMode = Demosaic::LUMA_WEIGHTED;
+            else if(strcmp(optarg, "GREEN") == 0)
+                demosaic_arg->lumaMode = Demosaic::LUMA_GREEN;
+            else {
+                std::cout << "Invalid luma mode " << optarg << std::endl;
+                return -1;
+            }
+            break;
+        case 'p':
+            demosaic_arg->planar = true;
+            break;
+        case 'n':
+            demosaic_arg->denoise = atof(optarg);
+            if (demosaic_arg->denoise <= 0) {
+                std::cout << "Invalid denoise sigma " << optarg << std::endl;
+                return -1;
+            }
+            break;
+        case 't':
+            demosaic_arg->tune = true;
+            break;
+        case 'k':
+            demosaic_arg->check = strdup(optarg);
+            break;
+        case 'r':
+            if(strcmp(optarg, "0") == 0)
+                demosaic_arg->orientation = ORIENTATION_NORMAL;
+            else if(strcmp(optarg, "90") == 0)
+                demosaic_arg->orientation = ORIENTATION_ROTATE_90;
+            else if(strcmp(optarg, "180") == 0)
+                demosaic_arg->orientation = ORIENTATION_ROTATE_180;
+            else if(strcmp(optarg, "270") == 0)
+                demosaic_arg->orientation = ORIENTATION_ROTATE_270;
+            else if(strcmp(optarg, "MIRROR_H") == 0)
+                demosaic_arg->orientation = ORIENTATION_MIRROR_H;
+            else if(strcmp(optarg, "MIRROR_V") == 0)
+                demosaic_arg->orientation = ORIENTATION_MIRROR_V;
+            else {
+                std::cout << "Invalid orientation " << optarg << std::endl;
                 return -1;
             }
             break;
@@ -168,6 +269,10 @@ static int parse_arg(int argc, char *argv[],
         }
     }
 
+    /* the self checks make their own images */
+    if (demosaic_arg->check)
+        return 0;
+
     if (demosaic_arg->inFileName == nullptr) {
         std::cout << "Invalid arg: input file not set" << std::endl;
         return -1;
@@ -184,6 +289,10 @@ static int parse_arg(int argc, char *argv[],
         std::cout << "Invalid arg: height not set" << std::endl;
         return -1;
     }
+    if (demosaic_arg->planar && demosaic_arg->denoise > 0) {
+        std::cout << "Invalid arg: denoise is not supported with planar" << std::endl;
+        return -1;
+    }
 
     if (demosaic_arg->stride == 0) {
         if (demosaic_arg->rawFmt == FORMAT_RAW8)
@@ -197,7 +306,8 @@ static int parse_arg(int argc, char *argv[],
     std::cout << demosaic_arg->width << " x " << demosaic_arg->height << "  "
         << "stride = " << demosaic_arg->stride << "  "
         << rawFormat2String(demosaic_arg->rawFmt) << "  "
-        << bayerPattern2String(demosaic_arg->cfa)
+        << (demosaic_arg->cfaLayout ? std::string(demosaic_arg->cfaLayout)
+                                    : bayerPattern2String(demosaic_arg->cfa))
         << std::endl;
 
     /* load input file */
@@ -231,24 +341,864 @@ static int parse_arg(int argc, char *argv[],
     return 0;
 }
 
+static uint32_t check_rand(uint32_t &seed)
+{
+    seed = seed * 1103515245 + 12345;
+
+    return seed >> 16;
+}
+
+/* RAW10 gradient with noise */
+static void check_fill_raw10(std::vector<uint16_t> &data, int width, int height,
+                             uint32_t &seed)
+{
+    data.resize(width * height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            data[y * width + x] = ((x * 5 + y * 3 + check_rand(seed) % 64) & 1023) << 6;
+}
+
+/* gradient with noise in the sample range of format */
+static void check_fill_raw(std::vector<uint8_t> &data, BayerImageData &bayer,
+                           uint32_t &seed)
+{
+    int bits = rawFormatBits(bayer.format);
+    int shift = rawFormatUnpackShift(bayer.format);
+    uint32_t mask = (1u << bits) - 1;
+
+    data.resize(bayer.imageSize());
+    for (int y = 0; y < bayer.height; y++) {
+        for (int x = 0; x < bayer.width; x++) {
+            uint32_t v = ((x * 5 + y * 3) << (bits - 8)) + check_rand(seed) % 64;
+
+            if (bayer.format == FORMAT_RAW8)
+                data[y * bayer.stride + x] = v & mask;
+            else
+                reinterpret_cast<uint16_t *>(data.data() + y * bayer.stride)[x] =
+                    (v & mask) << shift;
+        }
+    }
+}
+
+/*
+ * the planes of a frame converted with planar2RGB() and planar2RGBRegion()
+ * must equal bayer2RGB() and bayer2RGBRegion() on the interleaved frame,
+ * and merge back to the same bytes
+ */
+static int check_planar()
+{
+    const int width = 130;
+    const int height = 98;
+    const RawFormat_e rawFormats[] = {
+        FORMAT_RAW8, FORMAT_RAW10_UNPACKED, FORMAT_RAW12_UNPACKED,
+        FORMAT_RAW14_UNPACKED, FORMAT_RAW16,
+    };
+    const BayerCFAPattern_e cfas[] = {
+        BAYER_CFA_RGGB, BAYER_CFA_BGGR, BAYER_CFA_GRBG, BAYER_CFA_GBRG,
+    };
+    const RGBFormat_e rgbFormats[] = {FORMAT_RGB888, FORMAT_GRAY16};
+    const ImageRect region(3, 5, 67, 43);
+    uint32_t seed = 1;
+
+    for (RawFormat_e rawFormat : rawFormats) {
+        BayerImageData bayer, merged;
+        std::vector<uint8_t> bayerData, mergedData;
+
+        bayer.init(width, height, rawFormat);
+        check_fill_raw(bayerData, bayer, seed);
+        bayer.setImageData(bayerData.data());
+
+        for (BayerCFAPattern_e cfa : cfas) {
+            BayerPlanarImageData planar;
+            std::vector<uint8_t> planarData;
+
+            planar.init(width, height, cfa);
+            planarData.resize(planar.imageSize());
+            planar.setImageData(planarData.data());
+
+            merged.init(width, height, rawFormat);
+            mergedData.assign(merged.imageSize(), 0);
+            merged.setImageData(mergedData.data());
+
+            if (bayerSplitPlanes(bayer, planar) || bayerMergePlanes(planar, merged)) {
+                std::cout << "check planar: split or merge failed" << std::endl;
+                return -1;
+            }
+            if (mergedData != bayerData) {
+                std::cout << "check planar: format " << rawFormat << " cfa " << cfa
+                    << " does not merge back" << std::endl;
+                return -1;
+            }
+
+            for (int o = ORIENTATION_NORMAL; o <= ORIENTATION_MIRROR_V; o++) {
+                ImageOrientation_e orientation = static_cast<ImageOrientation_e>(o);
+                bool swap = orientation == ORIENTATION_ROTATE_90
+                    || orientation == ORIENTATION_ROTATE_270;
+                Demosaic demosaic;
+
+                demosaic.setOrientation(orientation);
+                for (RGBFormat_e rgbFormat : rgbFormats) {
+                    RGBImageData rgb, ref;
+                    rgb.init(swap ? height : width, swap ? width : height, rgbFormat);
+                    ref.init(swap ? height : width, swap ? width : height, rgbFormat);
+                    std::vector<uint8_t> rgbData(rgb.imageSize()), refData(ref.imageSize());
+                    rgb.setImageData(rgbData.data());
+                    ref.setImageData(refData.data());
+
+                    if (demosaic.planar2RGB(planar, rgb) || demosaic.bayer2RGB(bayer, cfa, ref)) {
+                        std::cout << "check planar: conversion failed" << std::endl;
+                        return -1;
+                    }
+                    if (rgbData != refData) {
+                        std::cout << "check planar: format " << rawFormat << " cfa " << cfa
+                            << " orientation " << o << " differs from bayer2RGB" << std::endl;
+                        return -1;
+                    }
+
+                    rgbData.assign(rgbData.size(), 0);
+                    refData.assign(refData.size(), 0);
+                    if (demosaic.planar2RGBRegion(planar, region, rgb)
+                        || demosaic.bayer2RGBRegion(bayer, cfa, region, ref)) {
+                        std::cout << "check planar: region conversion failed" << std::endl;
+                        return -1;
+                    }
+                    if (rgbData != refData) {
+                        std::cout << "check planar: format " << rawFormat << " cfa " << cfa
+                            << " orientation " << o << " region differs from bayer2RGBRegion"
+                            << std::endl;
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << "check planar: OK" << std::endl;
+
+    return 0;
+}
+
+/*
+ * random pixel edits on a frame which is not a multiple of the tile
+ * size, every incremental output must equal a full bayer2RGB(). change,
+ * if set, reconfigures the demosaic in the middle of the stream.
+ */
+static int check_incremental_stream(const char *name, Demosaic &demosaic,
+                                    const CFADescriptor &cfa, RGBFormat_e rgbFmt,
+                                    void (*change)(Demosaic &) = nullptr)
+{
+    const int width = 130;
+    const int height = 98;
+    uint32_t seed = 1;
+    std::vector<uint16_t> bayerData;
+
+    check_fill_raw10(bayerData, width, height, seed);
+
+    BayerImageData bayer;
+    bayer.init(width, height, FORMAT_RAW10_UNPACKED);
+    bayer.setImageData(bayerData.data());
+
+    RGBImageData rgb, ref;
+    rgb.init(width, height, rgbFmt);
+    ref.init(width, height, rgbFmt);
+    std::vector<uint8_t> rgbData(rgb.imageSize()), refData(ref.imageSize());
+    rgb.setImageData(rgbData.data());
+    ref.setImageData(refData.data());
+
+    IncrementalDemosaic incremental(demosaic, 16);
+    std::vector<ImageRect> dirtyRects;
+
+    for (int frame = 0; frame < 50; frame++) {
+        int edits = 1 + check_rand(seed) % 4;
+
+        if (frame == 25 && change)
+            change(demosaic);
+
+        for (int i = 0; i < edits; i++) {
+            /* the first edit of the first frames is in the last tile column */
+            int x = frame < 4 && i == 0 ? width - 1 : check_rand(seed) % width;
+            int y = check_rand(seed) % height;
+
+            bayerData[y * width + x] = (check_rand(seed) & 1023) << 6;
+        }
+
+        if (incremental.bayer2RGB(bayer, cfa, rgb, dirtyRects)
+            || demosaic.bayer2RGB(bayer, cfa, ref)) {
+            std::cout << "check incremental " << name << ": conversion failed" << std::endl;
+            return -1;
+        }
+        if (rgbData != refData) {
+            std::cout << "check incremental " << name << ": frame " << frame
+                << " differs from bayer2RGB" << std::endl;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void check_set_luma_green(Demosaic &demosaic)
+{
+    demosaic.setLumaMode(Demosaic::LUMA_GREEN);
+}
+
+static RawDenoise check_denoise;
+
+static void check_set_denoise(Demosaic &demosaic)
+{
+    demosaic.setRawDenoise(&check_denoise);
+}
+
+static int check_incremental()
+{
+    Demosaic demosaic;
+    CFADescriptor quad;
+
+    quad.initQuadBayer(BAYER_CFA_RGGB);
+    if (check_incremental_stream("RGGB", demosaic, BAYER_CFA_RGGB, FORMAT_RGB888)
+        || check_incremental_stream("quad", demosaic, quad, FORMAT_RGB888))
+        return -1;
+
+    Demosaic luma;
+    if (check_incremental_stream("luma switch", luma, BAYER_CFA_RGGB, FORMAT_GRAY8,
+                                 check_set_luma_green))
+        return -1;
+
+    /* the fused denoise widens the dirty halo by a CFA period */
+    check_denoise.setRangeSigma(0.05f);
+    Demosaic denoise;
+    if (check_incremental_stream("denoise switch", denoise, BAYER_CFA_RGGB, FORMAT_RGB888,
+                                 check_set_denoise)
+        || check_incremental_stream("denoise quad", denoise, quad, FORMAT_RGB888))
+        return -1;
+
+    std::cout << "check incremental: OK" << std::endl;
+
+    return 0;
+}
+
+/*
+ * every orientation must equal a pixel by pixel rotate or mirror of the
+ * ORIENTATION_NORMAL output, on an odd frame which is not a multiple of
+ * the rotation block, with and without streaming stores
+ */
+static int check_orientation()
+{
+    const int width = 203;
+    const int height = 141;
+    const RGBFormat_e rgbFormats[] = {
+        FORMAT_RGB888, FORMAT_RGBA8888, FORMAT_GRAY8, FORMAT_GRAY16,
+    };
+    const Demosaic::StreamingStore streamingStores[] = {
+        Demosaic::STREAMING_STORE_OFF, Demosaic::STREAMING_STORE_ON,
+    };
+    CFADescriptor cfas[2]; /* RGGB and quad */
+    uint32_t seed = 1;
+
+    cfas[1].initQuadBayer(BAYER_CFA_RGGB);
+
+    BayerImageData bayer;
+    std::vector<uint8_t> bayerData;
+    bayer.init(width, height, FORMAT_RAW10_UNPACKED);
+    check_fill_raw(bayerData, bayer, seed);
+    bayer.setImageData(bayerData.data());
+
+    for (const CFADescriptor &cfa : cfas) {
+        for (RGBFormat_e rgbFormat : rgbFormats) {
+            RGBImageData normal;
+            normal.init(width, height, rgbFormat);
+            std::vector<uint8_t> normalData(normal.imageSize());
+            normal.setImageData(normalData.data());
+
+            Demosaic demosaic;
+            if (demosaic.bayer2RGB(bayer, cfa, normal)) {
+                std::cout << "check orientation: conversion failed" << std::endl;
+                return -1;
+            }
+
+            int bpp = normal.stride / width;
+
+            for (int o = ORIENTATION_NORMAL; o <= ORIENTATION_MIRROR_V; o++) {
+                ImageOrientation_e orientation = static_cast<ImageOrientation_e>(o);
+                bool swap = orientation == ORIENTATION_ROTATE_90
+                    || orientation == ORIENTATION_ROTATE_270;
+
+                RGBImageData rgb, ref;
+                rgb.init(swap ? height : width, swap ? width : height, rgbFormat);
+                ref.init(swap ? height : width, swap ? width : height, rgbFormat);
+                std::vector<uint8_t> rgbData(rgb.imageSize()), refData(ref.imageSize());
+                rgb.setImageData(rgbData.data());
+                ref.setImageData(refData.data());
+
+                for (int y = 0; y < height; y++) {
+                    for (int x = 0; x < width; x++) {
+                        int dx = x;
+                        int dy = y;
+
+                        switch (orientation) {
+                        case ORIENTATION_ROTATE_90:
+                            dx = height - 1 - y;
+                            dy = x;
+                            break;
+                        case ORIENTATION_ROTATE_180:
+                            dx = width - 1 - x;
+                            dy = height - 1 - y;
+                            break;
+                        case ORIENTATION_ROTATE_270:
+                            dx = y;
+                            dy = width - 1 - x;
+                            break;
+                        case ORIENTATION_MIRROR_H:
+                            dx = width - 1 - x;
+                            break;
+                        case ORIENTATION_MIRROR_V:
+                            dy = height - 1 - y;
+                            break;
+                        default:
+                            break;
+                        }
+                        memcpy(&refData[dy * ref.stride + dx * bpp],
+                               &normalData[y * normal.stride + x * bpp], bpp);
+                    }
+                }
+
+                for (Demosaic::StreamingStore streamingStore : streamingStores) {
+                    demosaic.setOrientation(orientation);
+                    demosaic.setStreamingStore(streamingStore);
+                    rgbData.assign(rgbData.size(), 0);
+                    if (demosaic.bayer2RGB(bayer, cfa, rgb)) {
+                        std::cout << "check orientation: conversion failed" << std::endl;
+                        return -1;
+                    }
+                    if (rgbData != refData) {
+                        std::cout << "check orientation: period " << cfa.period
+                            << " format " << rgbFormat << " orientation " << o
+                            << " streaming " << streamingStore
+                            << " differs from the rotated normal output" << std::endl;
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << "check orientation: OK" << std::endl;
+
+    return 0;
+}
+
+/*
+ * the fused denoise of bayer2RGB()/bayer2RGBRegion() must equal
+ * RawDenoise::denoise() followed by the plain conversion, on an odd frame
+ * with bands which are not a multiple of the CFA period and regions
+ * touching the frame border
+ */
+static int check_raw_denoise()
+{
+    const int width = 131;
+    const int height = 97;
+    const RawFormat_e rawFormats[] = {FORMAT_RAW8, FORMAT_RAW10_UNPACKED};
+    const int bandHeights[] = {1, 5, 16};
+    const ImageRect regions[] = {
+        ImageRect(0, 0, width, height),
+        ImageRect(3, 5, 67, 43),
+        ImageRect(width - 9, height - 7, 9, 7),
+        ImageRect(0, 14, width, 3),
+    };
+    CFADescriptor cfas[3]; /* RGGB, quad and a 3x3 layout */
+    uint32_t seed = 1;
+
+    cfas[1].initQuadBayer(BAYER_CFA_GRBG);
+    if (cfas[2].init("RGBGBRBRG"))
+        return -1;
+
+    RawDenoise den;
+    den.setRangeSigma(0.05f);
+    den.setThreadCount(2);
+
+    for (RawFormat_e rawFormat : rawFormats) {
+        BayerImageData bayer, denoised;
+        std::vector<uint8_t> bayerData, denoisedData;
+
+        bayer.init(width, height, rawFormat);
+        check_fill_raw(bayerData, bayer, seed);
+        bayer.setImageData(bayerData.data());
+        denoised.init(width, height, rawFormat);
+        denoisedData.resize(denoised.imageSize());
+        denoised.setImageData(denoisedData.data());
+
+        for (const CFADescriptor &cfa : cfas) {
+            for (int bandHeight : bandHeights) {
+                den.setBandHeight(bandHeight);
+                if (den.denoise(bayer, cfa, denoised)) {
+                    std::cout << "check denoise: denoise failed" << std::endl;
+                    return -1;
+                }
+
+                for (int o = ORIENTATION_NORMAL; o <= ORIENTATION_MIRROR_V; o++) {
+                    ImageOrientation_e orientation = static_cast<ImageOrientation_e>(o);
+                    bool swap = orientation == ORIENTATION_ROTATE_90
+                        || orientation == ORIENTATION_ROTATE_270;
+                    Demosaic plain, fused;
+
+                    plain.setOrientation(orientation);
+                    fused.setOrientation(orientation);
+                    fused.setRawDenoise(&den);
+
+                    RGBImageData rgb, ref;
+                    rgb.init(swap ? height : width, swap ? width : height, FORMAT_RGB888);
+                    ref.init(swap ? height : width, swap ? width : height, FORMAT_RGB888);
+                    std::vector<uint8_t> rgbData(rgb.imageSize()), refData(ref.imageSize());
+                    rgb.setImageData(rgbData.data());
+                    ref.setImageData(refData.data());
+
+                    for (const ImageRect &region : regions) {
+                        rgbData.assign(rgbData.size(), 0);
+                        refData.assign(refData.size(), 0);
+                        if (fused.bayer2RGBRegion(bayer, cfa, region, rgb)
+                            || plain.bayer2RGBRegion(denoised, cfa, region, ref)) {
+                            std::cout << "check denoise: conversion failed" << std::endl;
+                            return -1;
+                        }
+                        if (rgbData != refData) {
+                            std::cout << "check denoise: format " << rawFormat
+                                << " period " << cfa.period << " band " << bandHeight
+                                << " orientation " << o << " region " << region.x << ","
+                                << region.y << " " << region.width << "x" << region.height
+                                << " differs from denoise() + bayer2RGB" << std::endl;
+                            return -1;
+                        }
+                    }
+
+                    if (fused.bayer2RGB(bayer, cfa, rgb) || plain.bayer2RGB(denoised, cfa, ref)
+                        || rgbData != refData) {
+                        std::cout << "check denoise: format " << rawFormat
+                            << " period " << cfa.period << " band " << bandHeight
+                            << " orientation " << o << " bayer2RGB differs" << std::endl;
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << "check denoise: OK" << std::endl;
+
+    return 0;
+}
+
+/*
+ * two RAW12 brackets (exposure 1 and 4) of a grey horizontal ramp, the
+ * long one saturates at a quarter of the ramp. The merged RAW16 and its
+ * RGB conversion must stay linear in the scene radiance across the knee.
+ */
+static int check_hdr()
+{
+    const int width = 256;
+    const int height = 16;
+    const float exposures[2] = {1.0f, 4.0f};
+    std::vector<uint16_t> frameData[2];
+    BayerImageData frames[2];
+
+    for (int i = 0; i < 2; i++) {
+        frameData[i].resize(width * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                float radiance = x * 4095.0f / (width - 1);
+                int v = static_cast<int>(radiance * exposures[i] + 0.5f);
+
+                frameData[i][y * width + x] = (v > 4095 ? 4095 : v) << 4;
+            }
+        }
+        frames[i].init(width, height, FORMAT_RAW12_UNPACKED);
+        frames[i].setImageData(frameData[i].data());
+    }
+
+    std::vector<uint16_t> hdrData(width * height);
+    BayerImageData hdr;
+    hdr.init(width, height, FORMAT_RAW16);
+    hdr.setImageData(hdrData.data());
+
+    HdrMerge merge;
+    if (merge.merge(frames, exposures, 2, hdr)) {
+        std::cout << "check hdr: merge failed" << std::endl;
+        return -1;
+    }
+
+    /* the full scale of the short exposure is 65535 */
+    for (int x = 0; x < width; x++) {
+        float expected = x * 65535.0f / (width - 1);
+        float v = hdrData[(height / 2) * width + x];
+
+        if (std::abs(v - expected) > 16 + expected * 0.01f) {
+            std::cout << "check hdr: merged column " << x << " is " << v
+                << ", expected " << expected << std::endl;
+            return -1;
+        }
+    }
+
+    RGBImageData rgb;
+    rgb.init(width, height, FORMAT_RGB888);
+    std::vector<uint8_t> rgbData(rgb.imageSize());
+    rgb.setImageData(rgbData.data());
+
+    Demosaic demosaic;
+    if (demosaic.bayer2RGB(hdr, BAYER_CFA_RGGB, rgb)) {
+        std::cout << "check hdr: bayer2RGB failed" << std::endl;
+        return -1;
+    }
+
+    for (int x = 1; x < width - 1; x++) {
+        float expected = x * 255.0f / (width - 1);
+
+        for (int c = 0; c < 3; c++) {
+            float v = rgbData[(height / 2) * rgb.stride + x * 3 + c];
+
+            if (std::abs(v - expected) > 2) {
+                std::cout << "check hdr: RGB column " << x << " is " << v
+                    << ", expected " << expected << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    std::cout << "check hdr: OK" << std::endl;
+
+    return 0;
+}
+
+/*
+ * NODE_LOCAL scheduler on frames of allocFrame(), the output must equal
+ * bayer2RGB() and the pages are counted on the stream node. A single
+ * node host has no remote page, NUMA_POLICY_NONE samples no page.
+ */
+static int check_numa_frames(DemosaicScheduler &scheduler, Demosaic &demosaic,
+                             DemosaicStreamStats &stats)
+{
+    const int width = 130;
+    const int height = 98;
+    uint32_t seed = 1;
+    std::vector<uint16_t> bayerData;
+
+    check_fill_raw10(bayerData, width, height, seed);
+
+    int streamId = scheduler.addStream(demosaic);
+    if (streamId < 0) {
+        std::cout << "check numa: addStream failed" << std::endl;
+        return -1;
+    }
+
+    BayerImageData bayer;
+    RGBImageData rgb, ref;
+    bayer.init(width, height, FORMAT_RAW10_UNPACKED);
+    rgb.init(width, height, FORMAT_RGB888);
+    ref.init(width, height, FORMAT_RGB888);
+
+    void *bayerFrame = scheduler.allocFrame(streamId, bayer.imageSize());
+    void *rgbFrame = scheduler.allocFrame(streamId, rgb.imageSize());
+    std::vector<uint8_t> refData(ref.imageSize());
+    int rc = 0;
+
+    if (bayerFrame == nullptr || rgbFrame == nullptr) {
+        std::cout << "check numa: allocFrame failed" << std::endl;
+        rc = -1;
+    } else {
+        memcpy(bayerFrame, bayerData.data(), bayer.imageSize());
+        bayer.setImageData(bayerFrame);
+        rgb.setImageData(rgbFrame);
+        ref.setImageData(refData.data());
+
+        for (int frame = 0; frame < 3 && rc == 0; frame++) {
+            memset(rgbFrame, 0, rgb.imageSize());
+            if (scheduler.submit(streamId, bayer, BAYER_CFA_RGGB, rgb).get()
+                || demosaic.bayer2RGB(bayer, BAYER_CFA_RGGB, ref)) {
+                std::cout << "check numa: conversion failed" << std::endl;
+                rc = -1;
+            } else if (memcmp(rgbFrame, refData.data(), rgb.imageSize())) {
+                std::cout << "check numa: frame " << frame
+                    << " differs from bayer2RGB" << std::endl;
+                rc = -1;
+            }
+        }
+    }
+
+    if (rc == 0 && (scheduler.getStreamStats(streamId, stats) || stats.framesCompleted != 3)) {
+        std::cout << "check numa: missing stream stats" << std::endl;
+        rc = -1;
+    }
+
+    scheduler.freeFrame(bayerFrame, bayer.imageSize());
+    scheduler.freeFrame(rgbFrame, rgb.imageSize());
+    scheduler.removeStream(streamId);
+
+    return rc;
+}
+
+static int check_numa()
+{
+    Demosaic demosaic;
+    DemosaicStreamStats stats;
+
+    {
+        DemosaicScheduler scheduler(2, 16, DemosaicScheduler::NUMA_POLICY_NODE_LOCAL);
+
+        if (check_numa_frames(scheduler, demosaic, stats))
+            return -1;
+    }
+
+    /* move_pages() may be refused, e.g. in a sandbox */
+    uint64_t localPages = 0;
+    uint64_t remotePages = 0;
+    std::vector<uint8_t> probe(4096, 1);
+    bool countable = numaCountPages(probe.data(), probe.size(), 1, numaCurrentNode(),
+                                    localPages, remotePages) == 0;
+
+    if (countable && stats.localPages == 0) {
+        std::cout << "check numa: no local page counted" << std::endl;
+        return -1;
+    }
+    if (numaNodes().size() == 1 && (stats.remotePages || stats.remoteAccessRatio != 0)) {
+        std::cout << "check numa: remote pages on a single node, ratio "
+            << stats.remoteAccessRatio << std::endl;
+        return -1;
+    }
+
+    {
+        DemosaicScheduler scheduler(2, 16);
+
+        if (check_numa_frames(scheduler, demosaic, stats))
+            return -1;
+    }
+    if (stats.localPages || stats.remotePages) {
+        std::cout << "check numa: pages sampled without NUMA_POLICY_NODE_LOCAL" << std::endl;
+        return -1;
+    }
+
+    std::cout << "check numa: OK" << std::endl;
+
+    return 0;
+}
+
+struct CheckSchedulerStream {
+    const char *name;
+    int priority;
+    int weight;
+    int deadlineMs;
+};
+
+/*
+ * the frames of a single worker scheduler, in submission order, with the
+ * order they must complete in: priority first, then the earliest deadline,
+ * then the lowest busy time / weight. The busy time is wall time, the
+ * large weight keeps the order when the worker is descheduled in a band.
+ */
+static const CheckSchedulerStream check_scheduler_streams[] = {
+    {"weight 1", 1, 1, 0},
+    {"weight 1000", 1, 1000, 0},
+    {"late deadline", 1, 1, 5000},
+    {"early deadline", 1, 1, 1000},
+    {"missed deadline", 0, 1, 1},
+    {"high priority", 2, 1, 0},
+};
+static const int check_scheduler_order[] = {5, 3, 2, 1, 0, 4};
+
+#define CHECK_SCHEDULER_STREAMS \
+    static_cast<int>(sizeof(check_scheduler_streams) / sizeof(check_scheduler_streams[0]))
+
+/*
+ * a large frame of a top priority stream holds the worker while the other
+ * frames are queued, then its priority drops to 0 so the other frames
+ * preempt it at its next band. A frame completes at its submit time plus
+ * its latency. Returns 1 if the large frame was too far along at the
+ * release to tell.
+ */
+static int check_scheduler_run()
+{
+    typedef std::chrono::steady_clock Clock;
+    const int width = 512;
+    const int height = 128;
+    uint32_t seed = 1;
+
+    BayerImageData bayer, blockerBayer;
+    std::vector<uint8_t> bayerData, blockerData;
+    bayer.init(width, height, FORMAT_RAW10_UNPACKED);
+    check_fill_raw(bayerData, bayer, seed);
+    bayer.setImageData(bayerData.data());
+    blockerBayer.init(2048, 1024, FORMAT_RAW10_UNPACKED);
+    check_fill_raw(blockerData, blockerBayer, seed);
+    blockerBayer.setImageData(blockerData.data());
+
+    RGBImageData blockerRgb;
+    blockerRgb.init(blockerBayer.width, blockerBayer.height, FORMAT_RGB888);
+    std::vector<uint8_t> blockerRgbData(blockerRgb.imageSize());
+    blockerRgb.setImageData(blockerRgbData.data());
+
+    RGBImageData rgb[CHECK_SCHEDULER_STREAMS];
+    std::vector<uint8_t> rgbData[CHECK_SCHEDULER_STREAMS];
+    std::future<int> results[CHECK_SCHEDULER_STREAMS];
+    Clock::time_point submitTimes[CHECK_SCHEDULER_STREAMS];
+    int streamIds[CHECK_SCHEDULER_STREAMS];
+
+    Demosaic demosaic;
+    DemosaicScheduler scheduler(1, 16);
+    DemosaicStreamStats released, stats;
+
+    int blocker = scheduler.addStream(demosaic, 10);
+    Clock::time_point blockerSubmitTime = Clock::now();
+    std::future<int> blockerResult = scheduler.submit(blocker, blockerBayer,
+                                                      BAYER_CFA_RGGB, blockerRgb);
+
+    /* wait for the worker to be inside the large frame */
+    do {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        scheduler.getStreamStats(blocker, stats);
+    } while (stats.busyTimeMs == 0);
+
+    for (int i = 0; i < CHECK_SCHEDULER_STREAMS; i++) {
+        const CheckSchedulerStream &s = check_scheduler_streams[i];
+
+        streamIds[i] = scheduler.addStream(demosaic, s.priority, s.weight);
+        rgb[i].init(width, height, FORMAT_RGB888);
+        rgbData[i].resize(rgb[i].imageSize());
+        rgb[i].setImageData(rgbData[i].data());
+        submitTimes[i] = Clock::now();
+        results[i] = scheduler.submit(streamIds[i], bayer, BAYER_CFA_RGGB, rgb[i],
+                                      s.deadlineMs);
+    }
+
+    /* the 1 ms deadline is missed whatever the speed of the host */
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    scheduler.setStreamPriority(blocker, 0);
+    scheduler.getStreamStats(blocker, released);
+
+    bool failed = blockerResult.get() != 0;
+    for (int i = 0; i < CHECK_SCHEDULER_STREAMS; i++)
+        failed = results[i].get() != 0 || failed;
+    if (failed) {
+        std::cout << "check scheduler: conversion failed" << std::endl;
+        return -1;
+    }
+
+    /* the large frame must have had most of its bands left at the release */
+    scheduler.getStreamStats(blocker, stats);
+    if (released.framesCompleted || released.busyTimeMs * 2 > stats.busyTimeMs)
+        return 1;
+
+    double doneMs[CHECK_SCHEDULER_STREAMS + 1];
+    for (int i = 0; i < CHECK_SCHEDULER_STREAMS; i++) {
+        const CheckSchedulerStream &s = check_scheduler_streams[i];
+
+        scheduler.getStreamStats(streamIds[i], stats);
+        if (stats.framesCompleted != 1
+            || stats.pixelsProcessed != static_cast<uint64_t>(width) * height
+            || stats.deadlineMisses != (s.deadlineMs && stats.maxLatencyMs > s.deadlineMs)) {
+            std::cout << "check scheduler: wrong stats of the " << s.name << " stream"
+                << std::endl;
+            return -1;
+        }
+        doneMs[i] = std::chrono::duration<double, std::milli>(
+            submitTimes[i] - submitTimes[0]).count() + stats.maxLatencyMs;
+    }
+    if (scheduler.getTotalStats().deadlineMisses < 1) {
+        std::cout << "check scheduler: the missed deadline is not counted" << std::endl;
+        return -1;
+    }
+
+    /* the preempted large frame completes last */
+    scheduler.getStreamStats(blocker, stats);
+    doneMs[CHECK_SCHEDULER_STREAMS] = std::chrono::duration<double, std::milli>(
+        blockerSubmitTime - submitTimes[0]).count() + stats.maxLatencyMs;
+    for (int i = 0; i < CHECK_SCHEDULER_STREAMS; i++) {
+        int first = check_scheduler_order[i];
+        int next = i + 1 < CHECK_SCHEDULER_STREAMS ? check_scheduler_order[i + 1]
+            : CHECK_SCHEDULER_STREAMS;
+
+        if (doneMs[first] >= doneMs[next]) {
+            std::cout << "check scheduler: the " << check_scheduler_streams[first].name
+                << " frame completed after the "
+                << (next < CHECK_SCHEDULER_STREAMS ? check_scheduler_streams[next].name
+                    : "preempted") << " frame" << std::endl;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int check_scheduler()
+{
+    int rc = 1;
+
+    /* a loaded host may run the large frame before the release */
+    for (int attempt = 0; attempt < 3 && rc > 0; attempt++)
+        rc = check_scheduler_run();
+    if (rc > 0)
+        std::cout << "check scheduler: the preempted frame ran too early" << std::endl;
+    if (rc)
+        return -1;
+
+    std::cout << "check scheduler: OK" << std::endl;
+
+    return 0;
+}
+
+static int run_check(const char *name)
+{
+    if (strcmp(name, "incremental") == 0)
+        return check_incremental();
+    if (strcmp(name, "hdr") == 0)
+        return check_hdr();
+    if (strcmp(name, "numa") == 0)
+        return check_numa();
+    if (strcmp(name, "planar") == 0)
+        return check_planar();
+    if (strcmp(name, "denoise") == 0)
+        return check_raw_denoise();
+    if (strcmp(name, "orientation") == 0)
+        return check_orientation();
+    if (strcmp(name, "scheduler") == 0)
+        return check_scheduler();
+
+    std::cout << "Invalid check " << name << std::endl;
+
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     struct test_demosaic_args demosaic_arg;
     int rc;
 
     memset(&demosaic_arg, 0, sizeof(demosaic_arg));
+    demosaic_arg.rgbFmt = FORMAT_RGB888;
 
     rc = parse_arg(argc, argv, &demosaic_arg);
     if (rc)
         return rc;
 
+    if (demosaic_arg.check)
+        return run_check(demosaic_arg.check) ? 1 : 0;
+
+    CFADescriptor cfa(demosaic_arg.cfa);
+    if (demosaic_arg.cfaLayout && cfa.init(demosaic_arg.cfaLayout)) {
+        delete [] demosaic_arg.bayerData;
+        return -1;
+    }
+
     BayerImageData bayerImageData;
     bayerImageData.init(demosaic_arg.width, demosaic_arg.height, demosaic_arg.rawFmt);
     bayerImageData.setImageData(demosaic_arg.bayerData);
 
+    int rgbWidth = demosaic_arg.width;
+    int rgbHeight = demosaic_arg.height;
+    if (demosaic_arg.orientation == ORIENTATION_ROTATE_90
+        || demosaic_arg.orientation == ORIENTATION_ROTATE_270) {
+        rgbWidth = demosaic_arg.height;
+        rgbHeight = demosaic_arg.width;
+    }
+
     RGBImageData rgbImageData;
-    rc = rgbImageData.init(demosaic_arg.width, demosaic_arg.height,
-            FORMAT_RGB888);
+    rc = rgbImageData.init(rgbWidth, rgbHeight, demosaic_arg.rgbFmt);
     if (rc) {
         std::cout << "Fail to init rgb image data" << std::endl;
         return rc;
@@ -258,8 +1208,51 @@ int main(int argc, char *argv[])
     rgbImageData.setImageData(rgbData);
 
     Demosaic demosaic;
+    demosaic.setOrientation(demosaic_arg.orientation);
+    demosaic.setLumaMode(demosaic_arg.lumaMode);
+
+    RawDenoise rawDenoise;
+    if (demosaic_arg.denoise > 0) {
+        rawDenoise.setRangeSigma(demosaic_arg.denoise);
+        demosaic.setRawDenoise(&rawDenoise);
+    }
+
+    if (demosaic_arg.tune) {
+        DemosaicTuner tuner;
+        DemosaicTuning tuning;
+
+        if (tuner.tune(demosaic, demosaic_arg.width, demosaic_arg.height,
+                       demosaic_arg.rawFmt, cfa, demosaic_arg.rgbFmt, tuning) == 0) {
+            std::cout << "Tuning: threads " << tuning.threadCount
+                << " band " << tuning.bandHeight << " tile " << tuning.tileSize
+                << (tuning.planar ? " planar" : " interleaved")
+                << " streaming " << tuning.streamingStore
+                << " (" << tuner.profilePath() << ")" << std::endl;
+            demosaic.setStreamingStore(tuning.streamingStore);
+            if (tuning.planar && !demosaic_arg.cfaLayout && !demosaic.rawDenoise())
+                demosaic_arg.planar = true;
+        }
+    }
 
-    rc = demosaic.bayer2RGB(bayerImageData, demosaic_arg.cfa, rgbImageData);
+    if (demosaic_arg.planar) {
+        BayerPlanarImageData planar;
+
+        if (demosaic_arg.cfaLayout
+            || planar.init(demosaic_arg.width, demosaic_arg.height, demosaic_arg.cfa)) {
+            std::cout << "Planar needs a 2x2 bayer CFA and an even size" << std::endl;
+            rc = -1;
+        } else {
+            uint8_t *planarData = new uint8_t[planar.imageSize()];
+
+            planar.setImageData(planarData);
+            rc = bayerSplitPlanes(bayerImageData, planar);
+            if (rc == 0)
+                rc = demosaic.planar2RGB(planar, rgbImageData);
+            delete [] planarData;
+        }
+    } else {
+        rc = demosaic.bayer2RGB(bayerImageData, cfa, rgbImageData);
+    }
     if (rc) {
         std::cout << "Fail to convert bayer to RGB" << std::endl;
         delete rgbData;